@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+
+"""Benchmark of r.pops.spread on synthetic landscapes.
+
+Run in a GRASS GIS session (any location, a temporary region is used).
+Synthetic host, infected, and weather rasters are generated for the given
+size and density and the module is executed repeatedly with the same
+inputs and all outputs (weather coefficients, final average, standard
+deviation, and probability, and their yearly series).
+
+Time of each part of the computation is taken from the profile written
+by the module (``profile`` option), so it does not include startup
+and input reading of other executions:
+
+simulation
+    runs of the simulation (Model::run_step including dispersal)
+weather reading
+    reading of weather coefficients (in background)
+statistics
+    aggregation of runs into average, standard deviation, and probability
+series writing
+    writing of the series (in background)
+output writing
+    writing of the final outputs
+
+Dispersal is not reported separately because Model::run_step in pops-core
+generates and moves dispersers internally without a way to time the parts,
+so the number of generated dispersers per second of simulation is reported
+instead.
+
+Weather coefficients are all 1, so the simulated spread does not
+depend on whether weather is used. Results are printed as JSON, so they
+can be stored and compared between versions of the module and pops-core,
+for example::
+
+    python3 benchmark_r_pops_spread.py --rows 1000 --cols 1000 > before.json
+
+or from the module directory with ``make benchmark``.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import statistics
+import subprocess
+import time
+
+import grass.script as gs
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description="Benchmark r.pops.spread on synthetic landscapes")
+    parser.add_argument("--rows", type=int, default=500)
+    parser.add_argument("--cols", type=int, default=500)
+    parser.add_argument("--host-density", type=float, default=0.8,
+                        help="Fraction of cells with host")
+    parser.add_argument("--infected-density", type=float, default=0.01,
+                        help="Fraction of host cells initially infected")
+    parser.add_argument("--years", type=int, default=2,
+                        help="Number of simulated years (weekly steps)")
+    parser.add_argument("--runs", type=int, default=10)
+    parser.add_argument("--nprocs", type=int, default=os.cpu_count())
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="Number of executions of the module")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--output", help="Output JSON file (default stdout)")
+    return parser.parse_args()
+
+
+def num_steps(args):
+    """Number of weekly steps (the last one can be partial)"""
+    start = datetime.date(2019, 1, 1)
+    end = datetime.date(2019 + args.years - 1, 12, 31)
+    return ((end - start).days + 1 + 6) // 7
+
+
+def create_inputs(args, prefix):
+    """Generate synthetic inputs, return names and weather file"""
+    gs.run_command("g.region", s=0, w=0, n=args.rows * 10, e=args.cols * 10,
+                   res=10)
+    host = prefix + "host"
+    total = prefix + "total"
+    infected = prefix + "infected"
+    gs.mapcalc("{host} = if(rand(0.0, 1.0) < {density}, rand(1, 100), 0)".format(
+        host=host, density=args.host_density), seed=args.seed)
+    gs.mapcalc("{total} = 100".format(total=total))
+    gs.mapcalc(
+        "{infected} = if({host} > 0 && rand(0.0, 1.0) < {density},"
+        " rand(1, {host}), 0)".format(
+            infected=infected, host=host, density=args.infected_density),
+        seed=args.seed + 1)
+    # one map for each week of the year, reused for all years
+    weather = []
+    for week in range(52):
+        name = "{prefix}weather_{week}".format(prefix=prefix, week=week)
+        # constant, so that weather does not change the spread
+        gs.mapcalc("{name} = 1.0".format(name=name))
+        weather.append(name)
+    weather_file = gs.tempfile(create=False)
+    with open(weather_file, "w") as file:
+        for step in range(num_steps(args)):
+            file.write(weather[step % len(weather)] + "\n")
+    return host, total, infected, weather_file
+
+
+def module_version():
+    """Commit of the module source if available"""
+    try:
+        return subprocess.check_output(
+            ["git", "describe", "--always", "--dirty"],
+            cwd=os.path.dirname(os.path.abspath(__file__)),
+            stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def profiled(repeat, profile, **kwargs):
+    """Return wall times and profiles of repeated module executions"""
+    times = []
+    profiles = []
+    for unused in range(repeat):
+        start = time.perf_counter()
+        gs.run_command("r.pops.spread", quiet=True, overwrite=True,
+                       profile=profile, **kwargs)
+        times.append(time.perf_counter() - start)
+        with open(profile) as file:
+            profiles.append(json.load(file))
+    return times, profiles
+
+
+def main():
+    args = parse_args()
+    prefix = "pops_benchmark_{}_".format(os.getpid())
+    outputs = prefix + "output"
+    weather_file = None
+    profile_file = gs.tempfile(create=False)
+    gs.use_temp_region()
+    try:
+        host, total, infected, weather_file = create_inputs(args, prefix)
+        start_year = 2019  # same as in num_steps()
+        end_year = start_year + args.years - 1
+        parameters = dict(
+            host=host, total_plants=total, infected=infected,
+            model_type="SI",
+            start_date="{}-01-01".format(start_year),
+            end_date="{}-12-31".format(end_year),
+            seasonality=[1, 12], step_unit="week", step_num_units=1,
+            reproductive_rate=4.4, natural_dispersal_kernel="cauchy",
+            natural_distance=20, natural_direction="none",
+            anthropogenic_dispersal_kernel="cauchy", anthropogenic_distance=1000,
+            percent_natural_dispersal=0.99,
+            random_seed=args.seed, runs=args.runs, nprocs=args.nprocs,
+            average=outputs)
+        steps = num_steps(args)
+        cells = args.rows * args.cols
+        times, profiles = profiled(
+            args.repeat, profile_file, weather_coefficient_file=weather_file,
+            stddev=outputs + "_stddev", probability=outputs + "_probability",
+            average_series=outputs + "_average",
+            stddev_series=outputs + "_stddev",
+            probability_series=outputs + "_probability", **parameters)
+        phases = {}
+        for name in ("simulation", "weather reading", "statistics",
+                     "series writing", "output writing", "input reading"):
+            seconds = [profile["phases"].get(name, {}).get("seconds", 0)
+                       for profile in profiles]
+            phases[name] = dict(times=seconds, median=statistics.median(seconds))
+        simulation = phases["simulation"]["median"]
+        if simulation:
+            phases["simulation"]["steps_per_second"] = steps * args.runs / simulation
+            phases["simulation"]["cells_per_second"] = (
+                cells * steps * args.runs / simulation)
+        total_time = dict(times=times, median=statistics.median(times))
+        counters = profiles[-1]["counters"]
+        dispersers = counters.get("dispersers generated")
+        if simulation and dispersers:
+            phases["simulation"]["dispersers_per_second"] = dispersers / simulation
+        result = dict(
+            module_version=module_version(),
+            grass_version=gs.version().get("version"),
+            machine=platform.machine(), processor=platform.processor(),
+            cpu_count=os.cpu_count(),
+            rows=args.rows, cols=args.cols, cells=cells,
+            host_density=args.host_density,
+            infected_density=args.infected_density,
+            steps=steps, runs=args.runs, nprocs=args.nprocs,
+            repeat=args.repeat, total=total_time, phases=phases,
+            counters=counters)
+        text = json.dumps(result, indent=2)
+        if args.output:
+            with open(args.output, "w") as file:
+                file.write(text + "\n")
+        else:
+            print(text)
+    finally:
+        gs.run_command("g.remove", flags="f", type="raster",
+                       pattern=prefix + "*", quiet=True)
+        if weather_file:
+            gs.try_remove(weather_file)
+        gs.try_remove(profile_file)
+        gs.del_temp_region()
+
+
+if __name__ == "__main__":
+    main()
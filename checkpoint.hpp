@@ -0,0 +1,233 @@
+/*
+ * PoPS model - Checkpoint files with state of all runs
+ *
+ * Copyright (C) 2021 by the authors.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include "pops/raster.hpp"
+
+extern "C" {
+#include <grass/gis.h>
+#include <grass/glocale.h>
+}
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/** Compressed binary stream for writing or reading a checkpoint
+ *
+ * The same sequence of calls is used for writing and for reading,
+ * so the code describing the content of the file is written only once:
+ * when writing, values are written to the stream, when reading, the
+ * same variables are filled from the stream.
+ *
+ * Values are written in the native byte order, so the file is meant
+ * to be read on the same kind of machine, typically the same one.
+ *
+ * When writing, the data go to a temporary file which replaces the
+ * target file only in close(), so an interrupted writing never leaves
+ * an incomplete checkpoint behind. Any error is fatal.
+ */
+class CheckpointStream
+{
+public:
+    enum class Mode
+    {
+        Write,
+        Read
+    };
+
+    CheckpointStream(const std::string& name, Mode mode)
+        : name_(name), mode_(mode)
+    {
+        if (writing()) {
+            temporary_name_ = name + ".tmp";
+            // fastest compression, the state is mostly zeros anyway
+            file_ = gzopen(temporary_name_.c_str(), "wb1");
+        }
+        else {
+            file_ = gzopen(name.c_str(), "rb");
+        }
+        if (!file_)
+            G_fatal_error(_("Unable to open checkpoint file <%s>"),
+                          name.c_str());
+        gzbuffer(file_, 1 << 20);
+        char magic[8];
+        std::memcpy(magic, "POPSCKP1", 8);
+        bytes(magic, sizeof(magic));
+        if (std::memcmp(magic, "POPSCKP1", 8) != 0)
+            G_fatal_error(_("File <%s> is not a checkpoint file"
+                            " of this version"), name.c_str());
+    }
+
+    CheckpointStream(const CheckpointStream&) = delete;
+    CheckpointStream& operator=(const CheckpointStream&) = delete;
+
+    ~CheckpointStream()
+    {
+        if (file_) {
+            gzclose(file_);
+            if (writing())
+                std::remove(temporary_name_.c_str());
+        }
+    }
+
+    bool writing() const
+    {
+        return mode_ == Mode::Write;
+    }
+
+    /** Write or read a value of a trivially copyable type */
+    template<typename T>
+    void value(T& value)
+    {
+        bytes(&value, sizeof(T));
+    }
+
+    /** Write a value or check it is the same in the file
+     *
+     * This is for parameters which need to be the same to continue
+     * from the checkpoint.
+     */
+    template<typename T>
+    void check(T value, const char* description)
+    {
+        T stored = value;
+        bytes(&stored, sizeof(T));
+        if (stored != value)
+            G_fatal_error(_("Checkpoint file <%s> was created with"
+                            " different %s"), name_.c_str(), description);
+    }
+
+    /** Write or read a vector including its size */
+    template<typename T>
+    void values(std::vector<T>& values)
+    {
+        uint64_t size = values.size();
+        value(size);
+        if (!writing())
+            values.resize(size);
+        if (size)
+            bytes(values.data(), sizeof(T) * size);
+    }
+
+    /** Write or read raster values (raster needs to have the right size)
+     *
+     * Size of the cell type is checked too, because the integer type of
+     * the rasters can be changed at compile time.
+     *
+     * When reading, the values are read by blocks and a block is copied
+     * to the raster only when it differs, so pages of copy-on-write
+     * storage which stay zero are not allocated.
+     */
+    template<typename Number>
+    void raster(pops::Raster<Number>& raster)
+    {
+        check<uint32_t>(sizeof(Number), "cell type");
+        check<uint32_t>(raster.rows(), "number of rows");
+        check<uint32_t>(raster.cols(), "number of columns");
+        size_t size = sizeof(Number) * raster.rows() * raster.cols();
+        if (writing()) {
+            bytes(raster.data(), size);
+            return;
+        }
+        const size_t block = 4096;
+        char buffer[block];
+        char* target = reinterpret_cast<char*>(raster.data());
+        for (size_t offset = 0; offset < size; offset += block) {
+            size_t part = std::min(block, size - offset);
+            bytes(buffer, part);
+            if (std::memcmp(target + offset, buffer, part) != 0)
+                std::memcpy(target + offset, buffer, part);
+        }
+    }
+
+    /** Write or read rasters (the number of rasters needs to match) */
+    template<typename Number>
+    void rasters(std::vector<pops::Raster<Number>>& rasters)
+    {
+        check<uint32_t>(rasters.size(), "number of rasters");
+        for (auto& item : rasters)
+            raster(item);
+    }
+
+    /** Finish writing and replace the target file */
+    void close()
+    {
+        int status = gzclose(file_);
+        file_ = nullptr;
+        if (writing()) {
+            if (status != Z_OK)
+                G_fatal_error(_("Unable to write checkpoint file <%s>"),
+                              name_.c_str());
+            if (std::rename(temporary_name_.c_str(), name_.c_str()) != 0)
+                G_fatal_error(_("Unable to replace checkpoint file <%s>"),
+                              name_.c_str());
+        }
+    }
+
+private:
+    void bytes(void* data, size_t size)
+    {
+        // gzip functions work with unsigned int sizes
+        char* position = static_cast<char*>(data);
+        while (size) {
+            unsigned part = std::min<size_t>(size, 1u << 30);
+            int result = writing() ? gzwrite(file_, position, part)
+                                   : gzread(file_, position, part);
+            if (result != int(part)) {
+                if (writing())
+                    G_fatal_error(_("Unable to write checkpoint file <%s>"),
+                                  name_.c_str());
+                G_fatal_error(_("Unable to read checkpoint file <%s>"),
+                              name_.c_str());
+            }
+            position += part;
+            size -= part;
+        }
+    }
+
+    std::string name_;
+    std::string temporary_name_;
+    Mode mode_;
+    gzFile file_{nullptr};
+};
+
+/** Write or read cells where dispersers left the region */
+inline void checkpoint_cells(CheckpointStream& stream,
+                             std::vector<std::tuple<int, int>>& cells)
+{
+    std::vector<int32_t> flat;
+    if (stream.writing()) {
+        flat.reserve(2 * cells.size());
+        for (const auto& cell : cells) {
+            flat.push_back(std::get<0>(cell));
+            flat.push_back(std::get<1>(cell));
+        }
+    }
+    stream.values(flat);
+    if (!stream.writing()) {
+        cells.clear();
+        for (size_t i = 0; i + 1 < flat.size(); i += 2)
+            cells.emplace_back(flat[i], flat[i + 1]);
+    }
+}
+
+#endif // CHECKPOINT_HPP
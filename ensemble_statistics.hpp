@@ -0,0 +1,195 @@
+/*
+ * PoPS model - Statistics across stochastic runs
+ *
+ * Copyright (C) 2021 by the authors.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef ENSEMBLE_STATISTICS_HPP
+#define ENSEMBLE_STATISTICS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/** Compute average, standard deviation, and probability across runs
+ *
+ * All statistics are computed in one parallel sweep over rows without
+ * any temporary rasters. For each row, the row of every run is visited
+ * twice, first for the sum and the number of runs with non-zero value,
+ * then for the squared deviations from the mean. The order of
+ * operations is the same as when computing with whole rasters, so is
+ * the result.
+ *
+ * The output rasters need to be allocated with the size of the runs.
+ * Pass nullptr for statistics which are not needed. Standard deviation
+ * is the population one (divided by number of runs). Probability is
+ * in percent.
+ */
+template<typename IntegerRaster, typename FloatRaster>
+void ensemble_statistics(
+        const std::vector<IntegerRaster>& runs,
+        FloatRaster* average,
+        FloatRaster* stddev,
+        FloatRaster* probability,
+        unsigned num_threads
+        )
+{
+    typedef typename FloatRaster::NumberType Number;
+    if (runs.empty())
+        return;
+    unsigned num_runs = runs.size();
+    unsigned rows = runs[0].rows();
+    unsigned cols = runs[0].cols();
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        std::vector<Number> mean(cols);
+        std::vector<Number> count(cols);
+        std::vector<Number> deviations(cols);
+        #pragma omp for schedule(static)
+        for (unsigned row = 0; row < rows; row++) {
+            std::fill(mean.begin(), mean.end(), 0);
+            std::fill(count.begin(), count.end(), 0);
+            for (unsigned run = 0; run < num_runs; run++) {
+                const auto* values = runs[run].data() + row * cols;
+                for (unsigned col = 0; col < cols; col++) {
+                    mean[col] += values[col];
+                    count[col] += bool(values[col]);
+                }
+            }
+            for (unsigned col = 0; col < cols; col++)
+                mean[col] /= num_runs;
+            if (stddev) {
+                std::fill(deviations.begin(), deviations.end(), 0);
+                for (unsigned run = 0; run < num_runs; run++) {
+                    const auto* values = runs[run].data() + row * cols;
+                    for (unsigned col = 0; col < cols; col++) {
+                        Number difference = values[col] - mean[col];
+                        deviations[col] += difference * difference;
+                    }
+                }
+                Number* output = stddev->data() + row * cols;
+                for (unsigned col = 0; col < cols; col++)
+                    output[col] = std::sqrt(deviations[col] / num_runs);
+            }
+            if (average) {
+                Number* output = average->data() + row * cols;
+                std::copy(mean.begin(), mean.end(), output);
+            }
+            if (probability) {
+                Number* output = probability->data() + row * cols;
+                for (unsigned col = 0; col < cols; col++)
+                    output[col] = count[col] * 100 / num_runs;  // 0 to 100
+            }
+        }
+    }
+}
+
+/** Average, standard deviation, and probability of runs added one by one
+ *
+ * Runs are added as they are simulated, so the runs do not need to be
+ * in memory at the same time. Mean and sum of squared deviations are
+ * updated using Welford's algorithm. The result can differ from
+ * ensemble_statistics() in the last digits.
+ *
+ * Only the rasters for the requested statistics are allocated
+ * (standard deviation needs mean as well). Probability is in percent.
+ */
+template<typename FloatRaster>
+class RunningStatistics
+{
+public:
+    typedef typename FloatRaster::NumberType Number;
+
+    RunningStatistics(unsigned rows, unsigned cols,
+                      bool average, bool stddev, bool probability)
+        : rows_(rows), cols_(cols)
+    {
+        if (average || stddev)
+            mean_.assign(size_t(rows) * cols, 0);
+        if (stddev)
+            deviations_.assign(size_t(rows) * cols, 0);
+        if (probability)
+            count_.assign(size_t(rows) * cols, 0);
+    }
+
+    /** Add one run */
+    template<typename IntegerRaster>
+    void add(const IntegerRaster& run, unsigned num_threads)
+    {
+        ++num_runs_;
+        Number num_runs = num_runs_;
+        double nonzero = 0;
+        #pragma omp parallel for num_threads(num_threads) schedule(static) reduction(+:nonzero)
+        for (unsigned row = 0; row < rows_; row++) {
+            const auto* values = run.data() + size_t(row) * cols_;
+            size_t offset = size_t(row) * cols_;
+            for (unsigned col = 0; col < cols_; col++) {
+                Number value = values[col];
+                nonzero += bool(values[col]);
+                if (!count_.empty())
+                    count_[offset + col] += bool(values[col]);
+                if (mean_.empty())
+                    continue;
+                Number difference = value - mean_[offset + col];
+                mean_[offset + col] += difference / num_runs;
+                if (!deviations_.empty())
+                    deviations_[offset + col] +=
+                            difference * (value - mean_[offset + col]);
+            }
+        }
+        nonzero_cells_ += nonzero;
+    }
+
+    /** Number of runs added so far */
+    unsigned num_runs() const
+    {
+        return num_runs_;
+    }
+
+    /** Average number of cells with non-zero value in a run */
+    double average_nonzero_cells() const
+    {
+        return num_runs_ ? nonzero_cells_ / num_runs_ : 0;
+    }
+
+    /** Write statistics to allocated rasters, nullptr for the unneeded ones
+     *
+     * Only statistics requested in the constructor are available.
+     */
+    void get(FloatRaster* average, FloatRaster* stddev,
+             FloatRaster* probability) const
+    {
+        size_t size = size_t(rows_) * cols_;
+        if (average)
+            std::copy(mean_.begin(), mean_.end(), average->data());
+        if (stddev) {
+            Number* output = stddev->data();
+            for (size_t i = 0; i < size; ++i)
+                output[i] = std::sqrt(deviations_[i] / num_runs_);
+        }
+        if (probability) {
+            Number* output = probability->data();
+            for (size_t i = 0; i < size; ++i)
+                output[i] = count_[i] * 100 / num_runs_;  // 0 to 100
+        }
+    }
+
+private:
+    unsigned rows_;
+    unsigned cols_;
+    unsigned num_runs_{0};
+    double nonzero_cells_{0};
+    std::vector<Number> mean_;
+    std::vector<Number> deviations_;
+    std::vector<Number> count_;
+};
+
+#endif // ENSEMBLE_STATISTICS_HPP
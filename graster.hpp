@@ -23,11 +23,36 @@ extern "C" {
 #include <grass/gis.h>
 #include <grass/glocale.h>
 #include <grass/raster.h>
+#include <grass/version.h>
 }
 
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <mutex>
 #include <string>
 #include <type_traits>
+#include <vector>
 
+// Reading one map through several file descriptors from several
+// threads requires the thread-safe raster library of GRASS GIS 8.3.
+#if defined(_OPENMP) && (GRASS_VERSION_MAJOR > 8 \
+    || (GRASS_VERSION_MAJOR == 8 && GRASS_VERSION_MINOR >= 3))
+#define GRASTER_PARALLEL_READ
+#endif
+
+
+/** Mutex for using GRASS GIS library from multiple threads
+ *
+ * GRASS GIS library is not thread-safe, so each thread which is
+ * reading or writing maps concurrently with other threads needs to
+ * hold this mutex while doing so.
+ */
+inline std::mutex& grass_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
 
 /** Convert pops::Date to GRASS GIS TimeStamp */
 void date_to_grass(pops::Date date, struct TimeStamp* timestamp)
@@ -90,19 +115,19 @@ inline void set_null_to_zero(Number* value)
 }
 
 /** Overload for put row function */
-inline void grass_raster_put_row(int fd, DCELL* buffer)
+inline void grass_raster_put_row(int fd, const DCELL* buffer)
 {
     Rast_put_d_row(fd, buffer);
 }
 
 /** Overload for put row function */
-inline void grass_raster_put_row(int fd, FCELL* buffer)
+inline void grass_raster_put_row(int fd, const FCELL* buffer)
 {
     Rast_put_f_row(fd, buffer);
 }
 
 /** Overload for put row function */
-inline void grass_raster_put_row(int fd, CELL* buffer)
+inline void grass_raster_put_row(int fd, const CELL* buffer)
 {
     Rast_put_c_row(fd, buffer);
 }
@@ -125,6 +150,31 @@ inline void grass_raster_set_null(CELL* buffer, int num_values = 1)
     Rast_set_c_null_value(buffer, num_values);
 }
 
+/** Type of GRASS GIS cell used to store values of a given type
+ *
+ * Integer types other than CELL are stored as CELL, so rows are
+ * converted when reading and writing.
+ */
+template<typename Number>
+struct GrassCellType
+{
+    typedef CELL type;
+};
+
+/** Specialization for GRASS GIS cell type */
+template<>
+struct GrassCellType<FCELL>
+{
+    typedef FCELL type;
+};
+
+/** Specialization for GRASS GIS cell type */
+template<>
+struct GrassCellType<DCELL>
+{
+    typedef DCELL type;
+};
+
 /** Policy settings for handling null values in the input */
 enum class NullInputPolicy
 {
@@ -147,6 +197,96 @@ enum class NullOutputPolicy
 // point in doing any conversions, so using it as default.
 constexpr auto DefaultNullOutputPolicy = NullOutputPolicy::NoConversions;
 
+/** Read a GRASS GIS raster map into an existing Raster
+ *
+ * The Raster needs to have the size of the current computational
+ * region. Use this function to avoid allocating a new Raster for
+ * every map when reading many maps of the same size.
+ *
+ * With *num_threads* larger than one, the map is opened multiple
+ * times and each thread decodes its own band of rows. This is
+ * available only when GRASTER_PARALLEL_READ is defined, otherwise
+ * the map is read by one thread.
+ *
+ * When the Raster has a type other than the GRASS GIS cell types,
+ * rows are converted from the map type. Values out of the range of
+ * the Raster type are a fatal error and null values are always
+ * converted to zeros.
+ */
+template<typename Number>
+inline void raster_from_grass(
+        const char* name,
+        pops::Raster<Number>& rast,
+        NullInputPolicy null_policy = DefaultNullInputPolicy,
+        unsigned num_threads = 1
+        )
+{
+    unsigned rows = rast.rows();
+    unsigned cols = rast.cols();
+    Number* data = rast.data();
+
+#ifndef GRASTER_PARALLEL_READ
+    num_threads = 1;
+#endif
+    num_threads = std::max(1u, std::min(num_threads, rows));
+    // opening and closing is not thread-safe
+    std::vector<int> fds(num_threads);
+    for (auto& fd : fds)
+        fd = Rast_open_old(name, "");
+    typedef typename GrassCellType<Number>::type Cell;
+    const bool convert = !std::is_same<Number, Cell>::value;
+    // first value out of range in each band (if any)
+    std::vector<Cell> out_of_range(num_threads);
+    std::vector<char> has_out_of_range(num_threads, false);
+    #pragma omp parallel for num_threads(num_threads) schedule(static, 1)
+    for (unsigned band = 0; band < num_threads; band++) {
+        unsigned first_row = band * rows / num_threads;
+        unsigned last_row = (band + 1) * rows / num_threads;
+        std::vector<Cell> row_buffer(convert ? cols : 0);
+        for (unsigned row = first_row; row < last_row; row++) {
+            auto row_pointer = data + (row * cols);
+            if (!convert) {
+                // same type, no conversion (cast only to compile)
+                Cell* cells = reinterpret_cast<Cell*>(row_pointer);
+                grass_raster_get_row(fds[band], cells, row);
+                if (null_policy == NullInputPolicy::NullsAsZeros) {
+                    for (unsigned col = 0; col < cols; ++col) {
+                        set_null_to_zero(cells + col);
+                    }
+                }
+                continue;
+            }
+            grass_raster_get_row(fds[band], row_buffer.data(), row);
+            for (unsigned col = 0; col < cols; ++col) {
+                Cell value = row_buffer[col];
+                if (grass_raster_is_null_value(&value)) {
+                    row_pointer[col] = 0;
+                    continue;
+                }
+                if (double(value) < double(std::numeric_limits<Number>::lowest())
+                        || double(value) > double(std::numeric_limits<Number>::max())) {
+                    if (!has_out_of_range[band]) {
+                        has_out_of_range[band] = true;
+                        out_of_range[band] = value;
+                    }
+                    continue;
+                }
+                row_pointer[col] = value;
+            }
+        }
+    }
+    for (auto fd : fds)
+        Rast_close(fd);
+    for (unsigned band = 0; band < num_threads; band++)
+        if (has_out_of_range[band])
+            G_fatal_error(_("Value %g in raster map <%s> does not fit"
+                            " into the cell type of the simulation"
+                            " (%g to %g)"),
+                          double(out_of_range[band]), name,
+                          double(std::numeric_limits<Number>::lowest()),
+                          double(std::numeric_limits<Number>::max()));
+}
+
 /** Read a GRASS GIS raster map to the Raster
  *
  * The caller is required to specify the type of the raster as a
@@ -162,26 +302,14 @@ constexpr auto DefaultNullOutputPolicy = NullOutputPolicy::NoConversions;
 template<typename Number>
 inline pops::Raster<Number> raster_from_grass(
         const char* name,
-        NullInputPolicy null_policy = DefaultNullInputPolicy
+        NullInputPolicy null_policy = DefaultNullInputPolicy,
+        unsigned num_threads = 1
         )
 {
     unsigned rows = Rast_window_rows();
     unsigned cols = Rast_window_cols();
     pops::Raster<Number> rast(rows, cols);
-    Number* data = rast.data();
-
-    int fd = Rast_open_old(name, "");
-    for (unsigned row = 0; row < rows; row++) {
-        auto row_pointer = data + (row * cols);
-        grass_raster_get_row(fd, row_pointer, row);
-        if (null_policy == NullInputPolicy::NullsAsZeros) {
-            for (unsigned col = 0; col < cols; ++col) {
-                set_null_to_zero(row_pointer + col);
-            }
-        }
-    }
-    Rast_close(fd);
-
+    raster_from_grass(name, rast, null_policy, num_threads);
     return rast;
 }
 
@@ -189,10 +317,11 @@ inline pops::Raster<Number> raster_from_grass(
 template<typename Number>
 inline pops::Raster<Number> raster_from_grass(
         const std::string& name,
-        NullInputPolicy null_policy = DefaultNullInputPolicy
+        NullInputPolicy null_policy = DefaultNullInputPolicy,
+        unsigned num_threads = 1
         )
 {
-    return raster_from_grass<Number>(name.c_str(), null_policy);
+    return raster_from_grass<Number>(name.c_str(), null_policy, num_threads);
 }
 
 /** Converts type to GRASS GIS raster map type identifier.
@@ -229,27 +358,41 @@ struct GrassRasterMapType<DCELL>
  */
 template<typename Number>
 void inline raster_to_grass(
-        pops::Raster<Number> raster,
+        const pops::Raster<Number>& raster,
         const char* name,
         NullOutputPolicy null_policy = DefaultNullOutputPolicy,
         const char* title = nullptr,
         struct TimeStamp* timestamp = nullptr
         )
 {
-    Number* data = raster.data();
+    const Number* data = raster.data();
     unsigned rows = raster.rows();
     unsigned cols = raster.cols();
 
-    int fd = Rast_open_new(name, GrassRasterMapType<Number>::value);
+    // nulls are set and other types converted in a copy of a row,
+    // so the raster is not modified
+    typedef typename GrassCellType<Number>::type Cell;
+    bool copy_rows = null_policy == NullOutputPolicy::ZerosAsNulls
+            || !std::is_same<Number, Cell>::value;
+    std::vector<Cell> row_buffer;
+    if (copy_rows)
+        row_buffer.resize(cols);
+
+    int fd = Rast_open_new(name, GrassRasterMapType<Cell>::value);
     for (unsigned i = 0; i < rows; i++) {
         auto row_pointer = data + (i * cols);
-        if (null_policy == NullOutputPolicy::ZerosAsNulls) {
+        // same type when rows are not copied (cast only to compile)
+        const Cell* cells = reinterpret_cast<const Cell*>(row_pointer);
+        if (copy_rows) {
             for (unsigned j = 0; j < cols; ++j) {
-                if (*(row_pointer + j) == 0)
-                    grass_raster_set_null(row_pointer + j);
+                row_buffer[j] = *(row_pointer + j);
+                if (null_policy == NullOutputPolicy::ZerosAsNulls
+                        && row_buffer[j] == 0)
+                    grass_raster_set_null(&row_buffer[j]);
             }
+            cells = row_buffer.data();
         }
-        grass_raster_put_row(fd, row_pointer);
+        grass_raster_put_row(fd, cells);
     }
     Rast_close(fd);
 
@@ -271,7 +414,7 @@ void inline raster_to_grass(
 /** Overload of raster_to_grass() */
 template<typename Number>
 inline void raster_to_grass(
-        pops::Raster<Number> raster,
+        const pops::Raster<Number>& raster,
         const std::string& name,
         NullOutputPolicy null_policy = DefaultNullOutputPolicy
         )
@@ -282,7 +425,7 @@ inline void raster_to_grass(
 /** Overload of raster_to_grass() */
 template<typename Number>
 inline void raster_to_grass(
-        pops::Raster<Number> raster,
+        const pops::Raster<Number>& raster,
         const std::string& name,
         const std::string& title,
         NullOutputPolicy null_policy = DefaultNullOutputPolicy
@@ -298,7 +441,7 @@ inline void raster_to_grass(
  */
 template<typename Number>
 inline void raster_to_grass(
-        pops::Raster<Number> raster,
+        const pops::Raster<Number>& raster,
         const std::string& name,
         const std::string& title,
         const pops::Date& date,
@@ -311,10 +454,35 @@ inline void raster_to_grass(
                             title.c_str(), &timestamp);
 }
 
+// Integer type of host and infection rasters can be set at compile
+// time, e.g., to uint16_t to reduce memory. Input values need to fit
+// into the type and so do the numbers of dispersers generated in a cell
+// (both checked when reading inputs).
+#ifndef POPS_INTEGER_TYPE
+#define POPS_INTEGER_TYPE int
+#endif
+
+// Floating point type of weather, temperature, and treatment rasters
+// can be set at compile time to float to reduce memory of these inputs.
+// Statistics of runs are always computed in double.
+#ifndef POPS_FLOAT_TYPE
+#define POPS_FLOAT_TYPE double
+#endif
+
 // these two determine the types of numbers used to represent the
 // rasters (using terminology already used in the library)
-typedef double Float;
-typedef int Integer;
+typedef POPS_FLOAT_TYPE Float;
+typedef POPS_INTEGER_TYPE Integer;
+
+static_assert(std::is_integral<Integer>::value,
+              "POPS_INTEGER_TYPE needs to be an integer type");
+// unsigned types are possible because susceptible hosts are computed
+// only when infected hosts are checked to be within hosts
+static_assert(std::numeric_limits<Integer>::max()
+              >= std::numeric_limits<uint16_t>::max(),
+              "POPS_INTEGER_TYPE needs to hold at least 16-bit values");
+static_assert(std::is_floating_point<Float>::value,
+              "POPS_FLOAT_TYPE needs to be a floating point type");
 
 // The following wrappers are to avoid the need specify template
 // parameters using the <> syntax and it is one place to change
@@ -328,25 +496,29 @@ typedef int Integer;
 template<typename String>
 inline pops::Raster<Float> raster_from_grass_float(
         String name,
-        NullInputPolicy null_policy = DefaultNullInputPolicy
+        NullInputPolicy null_policy = DefaultNullInputPolicy,
+        unsigned num_threads = 1
         )
 {
-    return raster_from_grass<Float>(name, null_policy);
+    return raster_from_grass<Float>(name, null_policy, num_threads);
 }
 
 /** Wrapper to read GRASS GIS raster into integer type Raster */
 template<typename String>
 inline pops::Raster<Integer> raster_from_grass_integer(
         String name,
-        NullInputPolicy null_policy = DefaultNullInputPolicy
+        NullInputPolicy null_policy = DefaultNullInputPolicy,
+        unsigned num_threads = 1
         )
 {
-    return raster_from_grass<Integer>(name, null_policy);
+    return raster_from_grass<Integer>(name, null_policy, num_threads);
 }
 
 // TODO: update names
 // convenient definitions, names for backwards compatibility
 typedef pops::Raster<Integer> Img;
 typedef pops::Raster<Float> DImg;
+// statistics and other results computed from the runs
+typedef pops::Raster<double> StatisticsImg;
 
 #endif // GRASTER_HPP
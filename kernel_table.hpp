@@ -0,0 +1,223 @@
+/*
+ * PoPS model - Precomputed tables for radial dispersal kernels
+ *
+ * Copyright (C) 2021 by the authors.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef KERNEL_TABLE_HPP
+#define KERNEL_TABLE_HPP
+
+#include "pops/kernel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+/** Angle of a direction in radians (clockwise from north) */
+inline double direction_to_radians(pops::Direction direction)
+{
+    using pops::Direction;
+    double degrees = 0;
+    switch (direction) {
+    case Direction::N: degrees = 0; break;
+    case Direction::NE: degrees = 45; break;
+    case Direction::E: degrees = 90; break;
+    case Direction::SE: degrees = 135; break;
+    case Direction::S: degrees = 180; break;
+    case Direction::SW: degrees = 225; break;
+    case Direction::W: degrees = 270; break;
+    case Direction::NW: degrees = 315; break;
+    default: degrees = 0;
+    }
+    return degrees * M_PI / 180;
+}
+
+/** Distribution of dispersal distance and direction of a radial kernel
+ *
+ * Distance follows half-Cauchy or exponential distribution with the
+ * given scale. Direction is measured clockwise from north and follows
+ * von Mises distribution, or uniform distribution when there is
+ * no direction.
+ */
+class RadialKernelDistribution
+{
+public:
+    RadialKernelDistribution(pops::DispersalKernelType type,
+                             double scale,
+                             pops::Direction direction,
+                             double kappa)
+        : type_(type), scale_(scale)
+    {
+        if (!supports_kernel(type))
+            throw std::invalid_argument(
+                    "Only Cauchy and exponential kernels can be tabulated");
+        // cumulative distribution of direction at regular angles
+        const unsigned num_angles = 3600;
+        angle_cdf_.resize(num_angles + 1);
+        angle_cdf_[0] = 0;
+        bool uniform = direction == pops::Direction::None || kappa <= 0;
+        double mu = direction_to_radians(direction);
+        for (unsigned i = 0; i < num_angles; ++i) {
+            double theta = 2 * M_PI * (i + 0.5) / num_angles;
+            double density = uniform ? 1 : std::exp(kappa * (std::cos(theta - mu) - 1));
+            angle_cdf_[i + 1] = angle_cdf_[i] + density;
+        }
+        for (auto& value : angle_cdf_)
+            value /= angle_cdf_.back();
+    }
+
+    static bool supports_kernel(pops::DispersalKernelType type)
+    {
+        return type == pops::DispersalKernelType::Cauchy
+                || type == pops::DispersalKernelType::Exponential;
+    }
+
+    /** Probability that the distance is smaller than *distance* */
+    double distance_cdf(double distance) const
+    {
+        if (type_ == pops::DispersalKernelType::Cauchy)
+            return 2 / M_PI * std::atan(distance / scale_);
+        return 1 - std::exp(-distance / scale_);
+    }
+
+    /** Distance for given value of cumulative distribution function */
+    double distance_quantile(double probability) const
+    {
+        if (type_ == pops::DispersalKernelType::Cauchy)
+            return scale_ * std::tan(M_PI / 2 * probability);
+        return -scale_ * std::log(1 - probability);
+    }
+
+    /** Probability that the angle is smaller than *theta* (in [0, 2 pi]) */
+    double angle_cdf(double theta) const
+    {
+        double position = theta / (2 * M_PI) * (angle_cdf_.size() - 1);
+        size_t index = std::min<size_t>(position, angle_cdf_.size() - 2);
+        double fraction = position - index;
+        return angle_cdf_[index]
+                + fraction * (angle_cdf_[index + 1] - angle_cdf_[index]);
+    }
+
+private:
+    pops::DispersalKernelType type_;
+    double scale_;
+    std::vector<double> angle_cdf_;
+};
+
+/** Probability of landing in each cell relative to the source cell
+ *
+ * The probabilities are integrated over rings and angular sectors
+ * of the kernel and assigned to cells the same way as the engine does
+ * it for individual dispersers, i.e., by rounding the offset in
+ * number of cells. Offsets are in range [-radius, radius] for both rows
+ * and columns. Probability of landing further than that is kept
+ * separately as the tail probability.
+ *
+ * The table is computed once per kernel configuration and is read-only
+ * afterwards, so it can be shared by all runs and threads.
+ */
+class DispersalKernelTable
+{
+public:
+    DispersalKernelTable(const RadialKernelDistribution& distribution,
+                         double ew_res,
+                         double ns_res,
+                         int radius)
+        : radius_(radius),
+          size_(2 * radius + 1),
+          tail_distance_((radius + 0.5) * std::min(ew_res, ns_res)),
+          probabilities_(size_ * size_, 0)
+    {
+        // any point closer than the tail distance rounds into the table
+        double ring_width = std::min(ew_res, ns_res) / 4;
+        unsigned num_rings = std::ceil(tail_distance_ / ring_width);
+        for (unsigned ring = 0; ring < num_rings; ++ring) {
+            double inner = ring * ring_width;
+            double outer = std::min(inner + ring_width, tail_distance_);
+            double middle = (inner + outer) / 2;
+            double ring_probability = distribution.distance_cdf(outer)
+                    - distribution.distance_cdf(inner);
+            // sectors about a quarter of a cell wide along the ring
+            unsigned num_sectors = std::max<unsigned>(
+                        64, std::ceil(2 * M_PI * middle / ring_width));
+            double previous_cdf = 0;
+            for (unsigned sector = 0; sector < num_sectors; ++sector) {
+                double start = 2 * M_PI * sector / num_sectors;
+                double end = 2 * M_PI * (sector + 1) / num_sectors;
+                double cdf = distribution.angle_cdf(end);
+                double theta = (start + end) / 2;
+                int row = -std::round(middle * std::cos(theta) / ns_res);
+                int col = std::round(middle * std::sin(theta) / ew_res);
+                at(row, col) += ring_probability * (cdf - previous_cdf);
+                previous_cdf = cdf;
+            }
+        }
+        tail_probability_ = 1 - distribution.distance_cdf(tail_distance_);
+    }
+
+    /** Smallest radius (in cells) with at most *tail* probability outside */
+    static int radius_for_tail(const RadialKernelDistribution& distribution,
+                               double ew_res, double ns_res, double tail)
+    {
+        double distance = distribution.distance_quantile(1 - tail);
+        return std::ceil(distance / std::min(ew_res, ns_res));
+    }
+
+    int radius() const
+    {
+        return radius_;
+    }
+
+    /** Probability of landing further than the table reaches */
+    double tail_probability() const
+    {
+        return tail_probability_;
+    }
+
+    /** Distance from which the landing is in the tail */
+    double tail_distance() const
+    {
+        return tail_distance_;
+    }
+
+    /** Probabilities by row-major offset index from (-radius, -radius) */
+    const std::vector<double>& probabilities() const
+    {
+        return probabilities_;
+    }
+
+    /** Row and column offset for an index to probabilities() */
+    std::tuple<int, int> offset(size_t index) const
+    {
+        return std::make_tuple(int(index / size_) - radius_,
+                               int(index % size_) - radius_);
+    }
+
+private:
+    size_t index(int row_offset, int col_offset) const
+    {
+        return (row_offset + radius_) * size_ + (col_offset + radius_);
+    }
+
+    double& at(int row_offset, int col_offset)
+    {
+        return probabilities_[index(row_offset, col_offset)];
+    }
+
+    int radius_;
+    size_t size_;
+    double tail_distance_;
+    double tail_probability_;
+    std::vector<double> probabilities_;
+};
+
+#endif // KERNEL_TABLE_HPP
@@ -16,6 +16,14 @@
  */
 
 #include "graster.hpp"
+#include "weather.hpp"
+#include "output_writer.hpp"
+#include "ensemble_statistics.hpp"
+#include "raster_storage.hpp"
+#include "mean_field.hpp"
+#include "random_streams.hpp"
+#include "checkpoint.hpp"
+#include "profile.hpp"
 
 #include "pops/model.hpp"
 #include "pops/date.hpp"
@@ -35,6 +43,8 @@ extern "C" {
 }
 
 #include <map>
+#include <limits>
+#include <array>
 #include <tuple>
 #include <vector>
 #include <iostream>
@@ -44,6 +54,8 @@ extern "C" {
 #include <sstream>
 #include <string>
 #include <cmath>
+#include <algorithm>
+#include <chrono>
 
 #include <sys/stat.h>
 
@@ -84,8 +96,14 @@ inline void file_exists_or_fatal_error(struct Option* option) {
                       option->key, option->answer);
 }
 
+/** Name of a raster in a series with date as a suffix
+ *
+ * Holds grass_mutex() because it is called while series are written
+ * in background.
+ */
 string generate_name(const string& basename, const Date& date)
 {
+    std::lock_guard<std::mutex> lock(grass_mutex());
     // counting on year being 4 digits
     auto year = G_double_to_basename_format(date.year(), 4, 0);
     auto month = G_double_to_basename_format(date.month(), 2, 0);
@@ -95,15 +113,20 @@ string generate_name(const string& basename, const Date& date)
     return name;
 }
 
-void write_average_area(const std::vector<Img>& infected, const char* raster_name,
-                        double ew_res, double ns_res)
+double average_infected_area(const std::vector<Img>& infected,
+                             double ew_res, double ns_res)
 {
-    struct History hist;
     double avg = 0;
     for (unsigned i = 0; i < infected.size(); i++) {
         avg += area_of_infected(infected[i], ew_res, ns_res);
     }
     avg /= infected.size();
+    return avg;
+}
+
+void write_average_area(double avg, const char* raster_name)
+{
+    struct History hist;
     string avg_string = "Average infected area: " + std::to_string(avg);
     Rast_read_history(raster_name, "", &hist);
     Rast_set_history(&hist, HIST_KEYWRD, avg_string.c_str());
@@ -143,6 +166,106 @@ void read_names(std::vector<string>& names, const char* filename)
     }
 }
 
+/** Treatment plan simulated by a group of runs */
+struct Scenario
+{
+    string name;  ///< Suffix of outputs (empty for single scenario)
+    std::vector<string> treatments;
+    std::vector<string> treatment_dates;
+    std::vector<unsigned> treatment_lengths;
+    string treatment_application{"ratio_to_all"};
+};
+
+std::vector<string> split_list(const string& text)
+{
+    std::vector<string> items;
+    std::istringstream stream(text);
+    string item;
+    while (std::getline(stream, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+/** Reads scenarios, one per line as key=value pairs
+ *
+ * Keys are name, treatments, treatment_date, treatment_length, and
+ * treatment_application with the same meaning and format as
+ * the module options. Empty lines and lines starting with # are skipped.
+ */
+std::vector<Scenario> read_scenarios(const char* filename)
+{
+    std::vector<Scenario> scenarios;
+    std::ifstream file(filename);
+    string line;
+    while (std::getline(file, line)) {
+        std::istringstream stream(line);
+        string pair;
+        if (!(stream >> pair) || pair[0] == '#')
+            continue;
+        Scenario scenario;
+        scenario.name = "scenario" + std::to_string(scenarios.size() + 1);
+        do {
+            size_t equals = pair.find('=');
+            if (equals == string::npos)
+                G_fatal_error(_("Scenario file <%s>: expected key=value, got <%s>"),
+                              filename, pair.c_str());
+            string key = pair.substr(0, equals);
+            string value = pair.substr(equals + 1);
+            if (key == "name")
+                scenario.name = value;
+            else if (key == "treatments")
+                scenario.treatments = split_list(value);
+            else if (key == "treatment_date")
+                scenario.treatment_dates = split_list(value);
+            else if (key == "treatment_length") {
+                for (const auto& item : split_list(value)) {
+                    if (item.empty() || item.size() > 9
+                            || item.find_first_not_of("0123456789") != string::npos)
+                        G_fatal_error(_("Scenario file <%s>: treatment_length"
+                                        " must be a non-negative integer, got <%s>"),
+                                      filename, item.c_str());
+                    scenario.treatment_lengths.push_back(std::stoul(item));
+                }
+            }
+            else if (key == "treatment_application") {
+                if (value != "ratio_to_all" && value != "all_infected_in_cell")
+                    G_fatal_error(_("Scenario file <%s>: treatment_application"
+                                    " must be ratio_to_all or all_infected_in_cell,"
+                                    " got <%s>"),
+                                  filename, value.c_str());
+                scenario.treatment_application = value;
+            }
+            else
+                G_fatal_error(_("Scenario file <%s>: unknown key <%s>"),
+                              filename, key.c_str());
+        } while (stream >> pair);
+        if (scenario.treatments.size() != scenario.treatment_dates.size()
+                || scenario.treatments.size() != scenario.treatment_lengths.size())
+            G_fatal_error(_("Scenario <%s>: treatments, treatment_date and"
+                            " treatment_length must have the same number of values"),
+                          scenario.name.c_str());
+        if (!scenario.name.empty() && G_legal_filename(scenario.name.c_str()) != 1)
+            G_fatal_error(_("Scenario name <%s> cannot be used in map names"),
+                          scenario.name.c_str());
+        for (const auto& other : scenarios)
+            if (other.name == scenario.name)
+                G_fatal_error(_("Scenario name <%s> is used more than once"),
+                              scenario.name.c_str());
+        scenarios.push_back(scenario);
+    }
+    if (scenarios.empty())
+        G_fatal_error(_("Scenario file <%s> contains no scenarios"), filename);
+    return scenarios;
+}
+
+/** Output name for a scenario (unchanged for the unnamed one) */
+string scenario_output_name(const char* name, const Scenario& scenario)
+{
+    if (scenario.name.empty())
+        return name;
+    return string(name) + "_" + scenario.name;
+}
+
 /*!
  * Warns about depreciated option value
  *
@@ -179,8 +302,216 @@ std::vector<double> weather_file_to_list(const string& filename)
     return output;
 }
 
+/** Groups simulation steps into chunks which end with an output step
+ *
+ * All runs simulate the whole chunk before the outputs are written.
+ * The last chunk ends with the last simulation step even when it is
+ * not an output step.
+ */
+std::vector<std::vector<unsigned>> output_chunks(const Config& config)
+{
+    std::vector<std::vector<unsigned>> chunks;
+    std::vector<unsigned> steps;
+    unsigned num_steps = config.scheduler().get_num_steps();
+    for (unsigned step = 0; step < num_steps; ++step) {
+        steps.push_back(step);
+        if (config.output_schedule()[step] || step == num_steps - 1) {
+            chunks.push_back(steps);
+            steps.clear();
+        }
+    }
+    return chunks;
+}
+
+/** Steps which are simulated together by all runs */
+struct StepBatch
+{
+    std::vector<unsigned> steps;
+    bool ends_chunk;  ///< Last batch of an output chunk
+};
+
+/** Splits output chunks into batches of at most max_steps steps
+ *
+ * The batches keep the order of steps, so simulating them one after
+ * another is the same as simulating the whole chunks.
+ */
+std::vector<StepBatch> step_batches(
+        const std::vector<std::vector<unsigned>>& chunks, unsigned max_steps)
+{
+    std::vector<StepBatch> batches;
+    for (const auto& chunk : chunks) {
+        for (size_t first = 0; first < chunk.size(); first += max_steps) {
+            size_t last = std::min(first + max_steps, chunk.size());
+            StepBatch batch;
+            batch.steps.assign(chunk.begin() + first, chunk.begin() + last);
+            batch.ends_chunk = last == chunk.size();
+            batches.push_back(batch);
+        }
+    }
+    return batches;
+}
+
+/** Statistics across stochastic runs or from the mean-field model
+ *
+ * The mean-field model provides average and probability directly,
+ * standard deviation is available only for stochastic runs.
+ */
+void simulation_statistics(const MeanFieldModel* mean_field,
+                           const std::vector<Img>& runs,
+                           StatisticsImg* average,
+                           StatisticsImg* stddev,
+                           StatisticsImg* probability,
+                           unsigned num_threads)
+{
+    if (!mean_field) {
+        ensemble_statistics(runs, average, stddev, probability, num_threads);
+        return;
+    }
+    if (average)
+        *average = mean_field->infected();
+    if (probability) {
+        *probability = mean_field->probability();
+        probability->for_each([](double& value) {
+            value *= 100;  // 0 to 100
+        });
+    }
+}
+
+/** Average spread rate of a step from rates restored from checkpoint
+ *
+ * Rates of each run are stored as north, south, east, west per step.
+ */
+std::tuple<double, double, double, double> average_restored_rate(
+        const std::vector<std::vector<double>>& rates, unsigned step)
+{
+    double n = 0;
+    double s = 0;
+    double e = 0;
+    double w = 0;
+    for (const auto& run : rates) {
+        n += run[4 * step];
+        s += run[4 * step + 1];
+        e += run[4 * step + 2];
+        w += run[4 * step + 3];
+    }
+    unsigned num_runs = rates.size();
+    return std::make_tuple(n / num_runs, s / num_runs, e / num_runs, w / num_runs);
+}
+
+/** Splits the batch containing *step* so that a batch starts with it */
+void split_batches_at(std::vector<StepBatch>& batches, unsigned step)
+{
+    for (size_t i = 0; i < batches.size(); ++i) {
+        auto& steps = batches[i].steps;
+        auto position = std::find(steps.begin() + 1, steps.end(), step);
+        if (position != steps.end()) {
+            StepBatch second;
+            second.steps.assign(position, steps.end());
+            second.ends_chunk = batches[i].ends_chunk;
+            steps.erase(position, steps.end());
+            batches[i].ends_chunk = false;
+            batches.insert(batches.begin() + i + 1, second);
+            return;
+        }
+    }
+}
+
+/** Copies values of a raster to another raster of the same size
+ *
+ * Only values which differ are written, so pages of copy-on-write
+ * storage which are the same in both rasters stay shared.
+ */
+void copy_raster_values(const Img& from, Img& to)
+{
+    size_t size = size_t(from.rows()) * from.cols();
+    const Integer* source = from.data();
+    Integer* target = to.data();
+    for (size_t i = 0; i < size; ++i)
+        if (target[i] != source[i])
+            target[i] = source[i];
+}
+
+/** Estimated memory used by parts of the simulation */
+struct MemoryEstimate
+{
+    std::vector<std::pair<string, double>> parts;  ///< Name and bytes
+
+    void add(const string& name, double bytes)
+    {
+        if (bytes > 0)
+            parts.emplace_back(name, bytes);
+    }
+
+    double total() const
+    {
+        double bytes = 0;
+        for (const auto& part : parts)
+            bytes += part.second;
+        return bytes;
+    }
+
+    /** Memory of one part (zero if not present) */
+    double part(const string& name) const
+    {
+        for (const auto& part : parts)
+            if (part.first == name)
+                return part.second;
+        return 0;
+    }
+};
+
+/** Estimates memory of rasters for the given region and options
+ *
+ * Exposed, resistant, and mortality rasters which the model does not
+ * use stay untouched in the sparse storage, so they are counted only
+ * when the model type and options need them. Raster sizes are exact,
+ * but the state rasters are counted as if all runs modified all their
+ * cells, so this is an upper bound.
+ *
+ * Weather buffer has *weather_slots* rasters.
+ *
+ * When runs are simulated in batches, *num_runs* is the size of a batch
+ * and *num_accumulated* is the number of rasters accumulating
+ * statistics of the batches.
+ */
+MemoryEstimate estimate_memory(const Config& config, unsigned num_runs,
+                               bool weather, bool moisture_temperature,
+                               unsigned weather_slots,
+                               size_t num_temperatures, size_t num_treatments,
+                               unsigned num_series, unsigned num_accumulated,
+                               bool mean_field)
+{
+    double cells = double(config.rows) * config.cols;
+    double integer = cells * sizeof(Img::NumberType);
+    double floating = cells * sizeof(DImg::NumberType);
+    MemoryEstimate estimate;
+    // host, total plants, infected, susceptible
+    estimate.add("input rasters", 4 * integer);
+    estimate.add("temperature rasters", num_temperatures * floating);
+    estimate.add("treatment rasters", num_treatments * floating);
+    // susceptible, infected, dispersers
+    unsigned layers = 3;
+    if (config.model_type == "SEI")
+        layers += config.latency_period_steps + 1;
+    if (config.use_mortality)
+        layers += config.num_mortality_years() + 1;
+    if (config.use_treatments)
+        layers += 1;
+    estimate.add("state of runs", double(num_runs) * layers * integer);
+    if (weather || moisture_temperature)
+        estimate.add("weather buffer", double(weather_slots) * floating
+                     + (moisture_temperature ? floating : 0));
+    // average, stddev, and probability computed together and copies
+    // of series waiting to be written
+    estimate.add("statistics", (3 + num_series) * cells * sizeof(double));
+    estimate.add("accumulated statistics", num_accumulated * cells * sizeof(double));
+    if (mean_field)
+        estimate.add("mean-field simulation", MeanFieldModel::memory(config));
+    return estimate;
+}
+
 /** Checks if there are any susceptible hosts left */
-bool all_infected(Img& susceptible)
+bool all_infected(const Img& susceptible)
 {
     for (Img::IndexType j = 0; j < susceptible.rows(); j++)
         for (Img::IndexType k = 0; k < susceptible.cols(); k++)
@@ -189,15 +520,114 @@ bool all_infected(Img& susceptible)
     return true;
 }
 
+/** Extent of infection as north and south row, west and east column
+ *
+ * All values are -1 when there is no infection.
+ */
+typedef std::array<int32_t, 4> InfectionExtent;
+
+/** Computes the extent of infected cells the spread rate is based on */
+InfectionExtent infection_extent(const Img& infected)
+{
+    InfectionExtent extent{{-1, -1, -1, -1}};
+    for (Img::IndexType j = 0; j < infected.rows(); j++) {
+        for (Img::IndexType k = 0; k < infected.cols(); k++) {
+            if (infected(j, k) > 0) {
+                if (extent[0] < 0) {
+                    extent = {{j, j, k, k}};
+                    continue;
+                }
+                extent[1] = j;
+                extent[2] = std::min<int32_t>(extent[2], k);
+                extent[3] = std::max<int32_t>(extent[3], k);
+            }
+        }
+    }
+    return extent;
+}
+
+/** Raster with the given extent of infection
+ *
+ * Only the north-west and south-east corners are infected, which gives
+ * the same extent to the spread rate as the original infection.
+ */
+Img infection_extent_raster(const InfectionExtent& extent,
+                            Img::IndexType rows, Img::IndexType cols)
+{
+    Img raster(rows, cols, 0);
+    if (extent[0] >= 0) {
+        raster(extent[0], extent[2]) = 1;
+        raster(extent[1], extent[3]) = 1;
+    }
+    return raster;
+}
+
+/** Checks that infected hosts are not more than hosts in any cell
+ *
+ * Susceptible hosts are computed as the difference which would wrap
+ * around for an unsigned integer type, so it is an error then. With
+ * a signed type, the original behavior with negative number of
+ * susceptible hosts is kept and only a warning is issued.
+ */
+void check_infected_within_host(const Img& host, const Img& infected,
+                                const char* host_name, const char* infected_name)
+{
+    for (Img::IndexType j = 0; j < host.rows(); j++) {
+        for (Img::IndexType k = 0; k < host.cols(); k++) {
+            if (infected(j, k) <= host(j, k))
+                continue;
+            if (std::is_unsigned<Integer>::value)
+                G_fatal_error(_("Number of infected hosts (%g) in raster map <%s>"
+                                " is larger than number of hosts (%g) in raster"
+                                " map <%s> at row %d and column %d"),
+                              double(infected(j, k)), infected_name,
+                              double(host(j, k)), host_name, j + 1, k + 1);
+            G_warning(_("Number of infected hosts (%g) in raster map <%s>"
+                        " is larger than number of hosts (%g) in raster"
+                        " map <%s> at row %d and column %d (and possibly"
+                        " in other cells)"),
+                      double(infected(j, k)), infected_name,
+                      double(host(j, k)), host_name, j + 1, k + 1);
+            return;
+        }
+    }
+}
+
+/** Checks that numbers of dispersers generated in a cell fit into Integer
+ *
+ * Each infected host generates dispersers from Poisson distribution with
+ * the reproductive rate (times weather coefficient which is at most 1)
+ * as the mean, so the limit is the mean for the most hosts in a cell
+ * plus ten standard deviations.
+ */
+void check_disperser_range(const Img& host, const Img& infected,
+                           double reproductive_rate)
+{
+    double hosts = 0;
+    for (Img::IndexType j = 0; j < host.rows(); j++)
+        for (Img::IndexType k = 0; k < host.cols(); k++)
+            hosts = std::max<double>(hosts, std::max(host(j, k), infected(j, k)));
+    double mean = hosts * reproductive_rate;
+    double limit = mean + 10 * std::sqrt(mean);
+    if (limit > std::numeric_limits<Integer>::max())
+        G_fatal_error(_("Dispersers generated from %g hosts in a cell with"
+                        " reproductive rate %g (up to %g) do not fit into"
+                        " the cell type of the simulation (up to %g)"),
+                      hosts, reproductive_rate, limit,
+                      double(std::numeric_limits<Integer>::max()));
+}
+
 struct PoPSOptions
 {
     struct Option *host, *total_plants, *infected, *outside_spores;
     struct Option *model_type;
+    struct Option *simulation_mode;
     struct Option *latency_period;
     struct Option *moisture_coefficient_file, *temperature_coefficient_file;
     struct Option *weather_coefficient_file;
     struct Option *lethal_temperature, *lethal_temperature_months;
     struct Option *temperature_file;
+    struct Option *weather_window;
     struct Option *start_date, *end_date, *seasonality;
     struct Option *step_unit, *step_num_units;
     struct Option *treatments;
@@ -211,19 +641,26 @@ struct PoPSOptions
     struct Option *percent_natural_dispersal;
     struct Option *infected_to_dead_rate, *first_year_to_die;
     struct Option *dead_series;
-    struct Option *seed, *runs, *threads;
+    struct Option *seed, *random_streams, *runs, *threads, *io_threads;
     struct Option *single_series;
     struct Option *average, *average_series;
     struct Option *stddev, *stddev_series;
     struct Option *probability, *probability_series;
     struct Option *spread_rate_output;
+    struct Option *profile;
     struct Option *output_frequency, *output_frequency_n;
+    struct Option *checkpoint, *checkpoint_frequency_n, *restart;
+    struct Option *fork_date;
+    struct Option *scenario_file;
+    struct Option *memory_limit;
+    struct Option *run_batch_size;
 };
 
 struct PoPSFlags
 {
     struct Flag *mortality;
     struct Flag *generate_seed;
+    struct Flag *estimate_memory;
 };
 
 
@@ -319,6 +756,15 @@ int main(int argc, char *argv[])
     opt.spread_rate_output->required = NO;
     opt.spread_rate_output->guisection = _("Output");
 
+    opt.profile = G_define_standard_option(G_OPT_F_OUTPUT);
+    opt.profile->key = "profile";
+    opt.profile->label =
+        _("Output JSON file with time of simulation phases and counters");
+    opt.profile->description =
+        _("Summary is also printed in verbose mode");
+    opt.profile->required = NO;
+    opt.profile->guisection = _("Output");
+
     opt.model_type = G_define_option();
     opt.model_type->type = TYPE_STRING;
     opt.model_type->key = "model_type";
@@ -342,6 +788,19 @@ int main(int argc, char *argv[])
     opt.latency_period->required = NO;
     opt.latency_period->guisection = _("Model");
 
+    opt.simulation_mode = G_define_option();
+    opt.simulation_mode->type = TYPE_STRING;
+    opt.simulation_mode->key = "simulation_mode";
+    opt.simulation_mode->label = _("Type of simulation");
+    opt.simulation_mode->answer = const_cast<char*>("stochastic");
+    opt.simulation_mode->options = "stochastic,mean_field";
+    opt.simulation_mode->descriptions =
+        _("stochastic;Stochastic runs;"
+          "mean_field;Deterministic expected values computed directly"
+          " (SI model spread only, no stochastic runs)");
+    opt.simulation_mode->required = NO;
+    opt.simulation_mode->guisection = _("Model");
+
     opt.treatments = G_define_standard_option(G_OPT_R_INPUT);
     opt.treatments->key = "treatments";
     opt.treatments->multiple = YES;
@@ -379,6 +838,20 @@ int main(int argc, char *argv[])
     opt.treatment_app->answer = const_cast<char*>("ratio_to_all");
     opt.treatment_app->guisection = _("Treatments");
 
+    opt.scenario_file = G_define_standard_option(G_OPT_F_INPUT);
+    opt.scenario_file->key = "scenario_file";
+    opt.scenario_file->label =
+        _("Input file with one treatment scenario per line");
+    opt.scenario_file->description =
+        _("Each line has key=value pairs for name, treatments,"
+          " treatment_date, treatment_length, and treatment_application"
+          " (lists separated by commas); runs are simulated for each"
+          " scenario and outputs have scenario name as a suffix;"
+          " with fork_date, treatments before the fork date must be"
+          " the same in all scenarios");
+    opt.scenario_file->required = NO;
+    opt.scenario_file->guisection = _("Treatments");
+
     opt.moisture_coefficient_file = G_define_standard_option(G_OPT_F_INPUT);
     opt.moisture_coefficient_file->key = "moisture_coefficient_file";
     opt.moisture_coefficient_file->label =
@@ -440,6 +913,55 @@ int main(int argc, char *argv[])
     opt.temperature_file->required = NO;
     opt.temperature_file->guisection = _("Weather");
 
+    opt.weather_window = G_define_option();
+    opt.weather_window->type = TYPE_INTEGER;
+    opt.weather_window->key = "weather_window";
+    opt.weather_window->label =
+        _("Number of steps with weather coefficients kept in memory");
+    opt.weather_window->description =
+        _("Weather for up to twice the number of steps is in memory"
+          " (one part is simulated while the other one is read);"
+          " by default, the largest number of steps between outputs");
+    opt.weather_window->options = "1-";
+    opt.weather_window->required = NO;
+    opt.weather_window->guisection = _("Weather");
+
+    opt.memory_limit = G_define_option();
+    opt.memory_limit->type = TYPE_INTEGER;
+    opt.memory_limit->key = "memory_limit";
+    opt.memory_limit->label = _("Maximum memory to be used (in MB)");
+    opt.memory_limit->description =
+        _("Weather window and number of runs simulated at the same time"
+          " are reduced to fit the limit, the module fails before"
+          " the simulation when the estimate still exceeds it;"
+          " with batches of runs, weather of all steps is kept in memory"
+          " if it fits the limit, otherwise it is read for each batch");
+    opt.memory_limit->options = "1-";
+    opt.memory_limit->required = NO;
+    opt.memory_limit->guisection = _("Memory");
+
+    opt.run_batch_size = G_define_option();
+    opt.run_batch_size->type = TYPE_INTEGER;
+    opt.run_batch_size->key = "run_batch_size";
+    opt.run_batch_size->label = _("Number of runs simulated at the same time");
+    opt.run_batch_size->description =
+        _("Runs are simulated in batches and their statistics accumulated,"
+          " so memory depends on the batch size, not the number of runs"
+          " (by default, all runs at once); weather is read again for"
+          " each batch unless all steps fit into weather_window"
+          " or memory_limit");
+    opt.run_batch_size->options = "1-";
+    opt.run_batch_size->required = NO;
+    opt.run_batch_size->guisection = _("Memory");
+
+    flg.estimate_memory = G_define_flag();
+    flg.estimate_memory->key = 'e';
+    flg.estimate_memory->label = _("Estimate memory and exit");
+    flg.estimate_memory->description =
+        _("Prints estimated memory for the region and options"
+          " without reading any raster or running the simulation");
+    flg.estimate_memory->guisection = _("Memory");
+
     opt.start_date = G_define_option();
     opt.start_date->type = TYPE_STRING;
     opt.start_date->key = "start_date";
@@ -664,6 +1186,21 @@ int main(int argc, char *argv[])
           " generator (use when you don't want to provide the seed option)");
     flg.generate_seed->guisection = _("Randomness");
 
+    opt.random_streams = G_define_option();
+    opt.random_streams->type = TYPE_STRING;
+    opt.random_streams->key = "random_streams";
+    opt.random_streams->label = _("Random number streams used by runs");
+    opt.random_streams->options = "run,chunk";
+    opt.random_streams->answer = const_cast<char*>("run");
+    opt.random_streams->descriptions =
+        _("run;One stream for each run seeded by consecutive seeds"
+          " starting with the random seed;"
+          "chunk;New stream for each run and each part of the simulation"
+          " between outputs (and from the fork date) derived from"
+          " the random seed, run, and step");
+    opt.random_streams->required = NO;
+    opt.random_streams->guisection = _("Randomness");
+
     opt.runs = G_define_option();
     opt.runs->key = "runs";
     opt.runs->type = TYPE_INTEGER;
@@ -683,6 +1220,60 @@ int main(int argc, char *argv[])
     opt.threads->options = "1-";
     opt.threads->guisection = _("Randomness");
 
+    opt.io_threads = G_define_option();
+    opt.io_threads->key = "nprocs_io";
+    opt.io_threads->type = TYPE_INTEGER;
+    opt.io_threads->required = NO;
+    opt.io_threads->label =
+        _("Number of threads for reading input raster maps");
+    opt.io_threads->description =
+        _("Each thread reads a different part of the map"
+          " (requires GRASS GIS 8.3 or later);"
+          " by default, the same as nprocs");
+    opt.io_threads->options = "1-";
+    opt.io_threads->guisection = _("Randomness");
+
+    opt.checkpoint = G_define_standard_option(G_OPT_F_OUTPUT);
+    opt.checkpoint->key = "checkpoint";
+    opt.checkpoint->label = _("Output checkpoint file with state of all runs");
+    opt.checkpoint->description =
+        _("Written after outputs, each time replacing the previous one"
+          " (requires random_streams=chunk)");
+    opt.checkpoint->required = NO;
+    opt.checkpoint->guisection = _("Checkpoint");
+
+    opt.checkpoint_frequency_n = G_define_option();
+    opt.checkpoint_frequency_n->type = TYPE_INTEGER;
+    opt.checkpoint_frequency_n->key = "checkpoint_frequency_n";
+    opt.checkpoint_frequency_n->description =
+        _("Write checkpoint every N outputs (1 by default)");
+    opt.checkpoint_frequency_n->options = "1-";
+    opt.checkpoint_frequency_n->required = NO;
+    opt.checkpoint_frequency_n->guisection = _("Checkpoint");
+
+    opt.restart = G_define_standard_option(G_OPT_F_INPUT);
+    opt.restart->key = "restart";
+    opt.restart->label = _("Input checkpoint file to continue from");
+    opt.restart->description =
+        _("Other parameters need to be the same as when the checkpoint"
+          " was written");
+    opt.restart->required = NO;
+    opt.restart->guisection = _("Checkpoint");
+
+    opt.fork_date = G_define_option();
+    opt.fork_date->type = TYPE_STRING;
+    opt.fork_date->key = "fork_date";
+    opt.fork_date->label =
+        _("Date when the runs start to differ (e.g. 2020-01-15)");
+    opt.fork_date->description =
+        _("Only one run is simulated until this date and all runs"
+          " continue from its state; outputs before this date are from"
+          " the one run; with scenario_file, the one run belongs to"
+          " the first scenario, so treatments before this date must be"
+          " the same in all scenarios");
+    opt.fork_date->required = NO;
+    opt.fork_date->guisection = _("Randomness");
+
     G_option_required(opt.average, opt.average_series, opt.single_series, opt.probability, opt.probability_series,
                       opt.outside_spores, opt.stddev, opt.stddev_series, NULL);
     G_option_requires_all(opt.average_series, opt.output_frequency, NULL);
@@ -691,6 +1282,9 @@ int main(int argc, char *argv[])
     G_option_requires_all(opt.stddev_series, opt.output_frequency, NULL);
     G_option_exclusive(opt.seed, flg.generate_seed, NULL);
     G_option_required(opt.seed, flg.generate_seed, NULL);
+    G_option_requires(opt.checkpoint_frequency_n, opt.checkpoint, NULL);
+    G_option_excludes(opt.scenario_file, opt.treatments, opt.treatment_date,
+                      opt.treatment_length, NULL);
 
     // weather
     G_option_collective(opt.moisture_coefficient_file, opt.temperature_coefficient_file, NULL);
@@ -726,10 +1320,57 @@ int main(int argc, char *argv[])
     if (opt.threads->answer)
         threads = std::stoul(opt.threads->answer);
 
+    // nothing else runs while inputs are read, so by default
+    // all threads read
+    unsigned io_threads = 1;
+    if (opt.io_threads->answer)
+        io_threads = std::stoul(opt.io_threads->answer);
+#ifdef GRASTER_PARALLEL_READ
+    else
+        io_threads = threads;
+#else
+    if (io_threads > 1) {
+        G_warning(_("Parallel reading of raster maps is not supported"
+                    " by this version of GRASS GIS, ignoring %s=%s"),
+                  opt.io_threads->key, opt.io_threads->answer);
+        io_threads = 1;
+    }
+#endif
+
+    // mean field covers only spread in SI model and has no runs
+    bool mean_field = opt.simulation_mode->answer == string("mean_field");
+    if (mean_field) {
+        for (auto unsupported : {opt.single_series, opt.stddev,
+                                 opt.stddev_series, opt.dead_series,
+                                 opt.treatments, opt.temperature_file,
+                                 opt.outside_spores, opt.spread_rate_output,
+                                 opt.checkpoint, opt.restart, opt.fork_date,
+                                 opt.scenario_file})
+            if (unsupported->answer)
+                G_fatal_error(_("Option %s is not supported for %s=%s"),
+                              unsupported->key, opt.simulation_mode->key,
+                              opt.simulation_mode->answer);
+        if (flg.mortality->answer)
+            G_fatal_error(_("Flag -%c is not supported for %s=%s"),
+                          flg.mortality->key, opt.simulation_mode->key,
+                          opt.simulation_mode->answer);
+        if (opt.model_type->answer != string("SI"))
+            G_fatal_error(_("Only %s=SI is supported for %s=%s"),
+                          opt.model_type->key, opt.simulation_mode->key,
+                          opt.simulation_mode->answer);
+        if (num_runs > 1)
+            G_warning(_("Option %s is ignored for %s=%s"),
+                      opt.runs->key, opt.simulation_mode->key,
+                      opt.simulation_mode->answer);
+        num_runs = 1;
+    }
+
     // check for file existence
     file_exists_or_fatal_error(opt.moisture_coefficient_file);
     file_exists_or_fatal_error(opt.temperature_coefficient_file);
     file_exists_or_fatal_error(opt.weather_coefficient_file);
+    file_exists_or_fatal_error(opt.restart);
+    file_exists_or_fatal_error(opt.scenario_file);
 
     // Start creating the configuration.
     Config config;
@@ -880,18 +1521,6 @@ int main(int argc, char *argv[])
                           flg.generate_seed->key, seed_value);
     }
 
-    // read the suspectible UMCA raster image
-    Img species_rast = raster_from_grass_integer(opt.host->answer);
-
-    // read the living trees raster image
-    Img lvtree_rast = raster_from_grass_integer(opt.total_plants->answer);
-
-    // read the initial infected oaks image
-    Img I_species_rast = raster_from_grass_integer(opt.infected->answer);
-
-    // create the initial suspectible oaks image
-    Img S_species_rast = species_rast - I_species_rast;
-
     std::vector<string> moisture_names;
     std::vector<string> temperature_names;
     std::vector<string> weather_names;
@@ -911,81 +1540,287 @@ int main(int argc, char *argv[])
     config.weather = weather || moisture_temperature;
 
     std::vector<string> actual_temperature_names;
-    std::vector<DImg> actual_temperatures;
-
     if (opt.temperature_file->answer) {
         unsigned count_lethal = config.num_lethal();
         file_exists_or_fatal_error(opt.temperature_file);
         read_names(actual_temperature_names, opt.temperature_file->answer);
-        for (string name : actual_temperature_names) {
-            actual_temperatures.push_back(raster_from_grass_float(name));
-        }
-        if (actual_temperatures.size() < count_lethal)
+        if (actual_temperature_names.size() < count_lethal)
             G_fatal_error(_("Not enough temperatures"));
     }
 
-    std::vector<DImg> weather_coefficients;
-    if (weather || moisture_temperature)
-        weather_coefficients.resize(config.scheduler().get_num_steps());
-
     // treatments
     if (get_num_answers(opt.treatments) != get_num_answers(opt.treatment_date) &&
             get_num_answers(opt.treatment_date) != get_num_answers(opt.treatment_length)){
         G_fatal_error(_("%s=, %s= and %s= must have the same number of values"),
                       opt.treatments->key, opt.treatment_date->key, opt.treatment_length->key);}
-    // the default here should be never used
-    TreatmentApplication treatment_app = TreatmentApplication::Ratio;
-    if (opt.treatment_app->answer)
-        treatment_app = treatment_app_enum_from_string(opt.treatment_app->answer);
-    Treatments<Img, DImg> treatments(config.scheduler());
-    config.use_treatments = false;
-    if (opt.treatments->answers) {
-        for (int i_t = 0; opt.treatment_date->answers[i_t]; i_t++) {
-            DImg tr = raster_from_grass_float(opt.treatments->answers[i_t]);
-            treatments.add_treatment(tr, treatment_date_from_string(opt.treatment_date->answers[i_t]),
-                                     std::stoul(opt.treatment_length->answers[i_t]), treatment_app);
-            config.use_treatments = true;
+    // without scenario file, there is one unnamed scenario from options
+    std::vector<Scenario> scenarios;
+    if (opt.scenario_file->answer) {
+        scenarios = read_scenarios(opt.scenario_file->answer);
+    }
+    else {
+        Scenario scenario;
+        for (unsigned i = 0; i < get_num_answers(opt.treatments); ++i) {
+            scenario.treatments.push_back(opt.treatments->answers[i]);
+            scenario.treatment_dates.push_back(opt.treatment_date->answers[i]);
+            scenario.treatment_lengths.push_back(
+                        std::stoul(opt.treatment_length->answers[i]));
+        }
+        // the default here should be never used
+        if (opt.treatment_app->answer)
+            scenario.treatment_application = opt.treatment_app->answer;
+        scenarios.push_back(scenario);
+    }
+    size_t num_treatments = 0;
+    for (const auto& scenario : scenarios)
+        num_treatments += scenario.treatments.size();
+    config.use_treatments = num_treatments > 0;
+
+    // runs of all scenarios are simulated together,
+    // each scenario uses the same seeds
+    unsigned runs_per_scenario = num_runs;
+    num_runs *= scenarios.size();
+
+    std::vector<std::vector<unsigned>> chunks = output_chunks(config);
+    unsigned weather_window = 0;
+    for (const auto& chunk : chunks)
+        weather_window = std::max<unsigned>(weather_window, chunk.size());
+    if (opt.weather_window->answer)
+        weather_window = std::stoul(opt.weather_window->answer);
+
+    // memory is checked before any raster is read or allocated,
+    // so that the estimate is also a dry run
+    unsigned num_series = 0;
+    for (auto series : {opt.single_series, opt.average_series,
+                        opt.stddev_series, opt.probability_series,
+                        opt.dead_series})
+        if (series->answer)
+            ++num_series;
+    // runs can be simulated in batches when they don't share state
+    unsigned run_batch_size = num_runs;
+    if (opt.run_batch_size->answer)
+        run_batch_size = std::min<unsigned>(
+                    num_runs, std::stoul(opt.run_batch_size->answer));
+    bool run_batches_possible = !opt.checkpoint->answer && !opt.restart->answer
+            && !opt.fork_date->answer;
+    if (run_batch_size < num_runs && !run_batches_possible)
+        G_fatal_error(_("Option %s cannot be combined with %s, %s, or %s"),
+                      opt.run_batch_size->key, opt.checkpoint->key,
+                      opt.restart->key, opt.fork_date->key);
+    // statistics of output steps and final statistics for each scenario
+    unsigned num_statistics_outputs = 1;
+    for (bool output : config.output_schedule())
+        num_statistics_outputs += output;
+    // with batches of runs, weather of all steps can be kept in memory,
+    // so that it is read only once, not for each batch
+    unsigned num_steps = config.scheduler().get_num_steps();
+    bool weather_resident = false;
+    auto weather_slots = [&]() {
+        return weather_resident ? num_steps : 2 * weather_window;
+    };
+    auto memory = [&](unsigned batch_size) {
+        unsigned layers = 0;
+        if (batch_size < num_runs) {
+            bool stddev = opt.stddev->answer || opt.stddev_series->answer;
+            layers += opt.average->answer || opt.average_series->answer || stddev;
+            layers += stddev;
+            layers += opt.probability->answer || opt.probability_series->answer;
+        }
+        return estimate_memory(config, batch_size, weather, moisture_temperature,
+                               weather_slots(), actual_temperature_names.size(),
+                               num_treatments, num_series,
+                               layers * num_statistics_outputs * scenarios.size(),
+                               mean_field);
+    };
+    const double mebibyte = 1024. * 1024.;
+    if (opt.memory_limit->answer) {
+        double limit = std::stod(opt.memory_limit->answer) * mebibyte;
+        double weather_slot = 2. * config.rows * config.cols
+                * sizeof(DImg::NumberType);
+        if (memory(run_batch_size).total() > limit && config.weather) {
+            // the smallest window is one step
+            MemoryEstimate estimate = memory(run_batch_size);
+            double available = limit - estimate.total()
+                    + estimate.part("weather buffer");
+            unsigned window = std::max(1., std::floor(available / weather_slot));
+            if (window < weather_window) {
+                weather_window = window;
+                G_verbose_message(_("Weather window reduced to %u steps"
+                                    " to fit %s=%s"), weather_window,
+                                  opt.memory_limit->key, opt.memory_limit->answer);
+            }
+        }
+        if (memory(run_batch_size).total() > limit && run_batches_possible
+                && !mean_field) {
+            // with accumulators, memory grows with the batch size
+            MemoryEstimate estimate = memory(1);
+            double run = estimate.part("state of runs");
+            double available = limit - estimate.total() + run;
+            unsigned size = std::max(1., std::floor(available / run));
+            if (size < run_batch_size) {
+                run_batch_size = size;
+                G_verbose_message(_("Runs are simulated in batches of %u"
+                                    " to fit %s=%s"), run_batch_size,
+                                  opt.memory_limit->key, opt.memory_limit->answer);
+            }
+        }
+        if (run_batch_size < num_runs && config.weather) {
+            // all steps are kept only when they still fit
+            weather_resident = true;
+            if (memory(run_batch_size).total() > limit)
+                weather_resident = false;
+        }
+        if (memory(run_batch_size).total() > limit && !flg.estimate_memory->answer)
+            G_fatal_error(_("Estimated memory %.1f MiB exceeds %s=%s"
+                            " (use -%c to see the estimate by parts)"),
+                          memory(run_batch_size).total() / mebibyte,
+                          opt.memory_limit->key, opt.memory_limit->answer,
+                          flg.estimate_memory->key);
+    }
+    // all steps take no more memory than the window
+    if (run_batch_size < num_runs && config.weather && num_steps <= 2 * weather_window)
+        weather_resident = true;
+    if (flg.estimate_memory->answer) {
+        MemoryEstimate estimate = memory(run_batch_size);
+        for (const auto& part : estimate.parts)
+            fprintf(stdout, "%s: %.1f MiB\n", part.first.c_str(),
+                    part.second / mebibyte);
+        fprintf(stdout, "total: %.1f MiB\n", estimate.total() / mebibyte);
+        return 0;
+    }
+    G_verbose_message(_("Estimated memory is at most %.1f MiB"),
+                      memory(run_batch_size).total() / mebibyte);
+    if (run_batch_size < num_runs && config.weather && !weather_resident)
+        G_verbose_message(_("Weather does not fit into memory for all steps,"
+                            " it is read again for each of %u batches of runs"),
+                          (num_runs + run_batch_size - 1) / run_batch_size);
+
+    // phases are timed when the profile is written or printed
+    Profile profile(opt.profile->answer || G_verbose() > G_verbose_std());
+    ProfileTimer input_timer(profile, "input reading");
+
+    // read the suspectible UMCA raster image
+    Img species_rast = raster_from_grass_integer(
+            opt.host->answer, DefaultNullInputPolicy, io_threads);
+
+    // read the living trees raster image
+    Img lvtree_rast = raster_from_grass_integer(
+            opt.total_plants->answer, DefaultNullInputPolicy, io_threads);
+
+    // read the initial infected oaks image
+    Img I_species_rast = raster_from_grass_integer(
+            opt.infected->answer, DefaultNullInputPolicy, io_threads);
+
+    check_infected_within_host(species_rast, I_species_rast,
+                               opt.host->answer, opt.infected->answer);
+    check_disperser_range(species_rast, I_species_rast, config.reproductive_rate);
+
+    // create the initial suspectible oaks image
+    Img S_species_rast = species_rast - I_species_rast;
+
+    std::vector<DImg> actual_temperatures;
+    for (const string& name : actual_temperature_names)
+        actual_temperatures.push_back(
+            raster_from_grass_float(name, DefaultNullInputPolicy, io_threads));
+
+    // treatment maps used by more scenarios are read only once
+    std::map<string, DImg> treatment_maps;
+    std::vector<std::unique_ptr<Treatments<Img, DImg>>> scenario_treatments;
+    for (const auto& scenario : scenarios) {
+        TreatmentApplication treatment_app =
+                treatment_app_enum_from_string(scenario.treatment_application);
+        scenario_treatments.emplace_back(
+                    new Treatments<Img, DImg>(config.scheduler()));
+        for (size_t i = 0; i < scenario.treatments.size(); ++i) {
+            const string& name = scenario.treatments[i];
+            if (!treatment_maps.count(name))
+                treatment_maps.emplace(
+                            name, raster_from_grass_float(
+                                name, DefaultNullInputPolicy, io_threads));
+            scenario_treatments.back()->add_treatment(
+                        treatment_maps.at(name),
+                        treatment_date_from_string(scenario.treatment_dates[i]),
+                        scenario.treatment_lengths[i], treatment_app);
         }
     }
+    treatment_maps.clear();
+    input_timer.stop();
+
+    bool run_batches = run_batch_size < num_runs;
+    std::vector<StepBatch> batches = step_batches(chunks, weather_window);
 
     // build the Sporulation object
     std::vector<Model<Img, DImg, int>> models;
     std::vector<Img> dispersers;
-    std::vector<Img> sus_species_rasts(num_runs, S_species_rast);
-    std::vector<Img> inf_species_rasts(num_runs, I_species_rast);
-    std::vector<Img> resistant_rasts(num_runs, Img(S_species_rast, 0));
+    // State is allocated for one batch of runs (all runs by default),
+    // so run below is index of a run within the batch.
+    // Runs share the initial state and the rasters which start as zeros
+    // until they modify them (storage needs to outlive the rasters).
+    CopyOnWriteStorage<Img> state_storage;
+    unsigned rows = S_species_rast.rows();
+    unsigned cols = S_species_rast.cols();
+    std::vector<Img> sus_species_rasts = state_storage.copies(S_species_rast, run_batch_size);
+    std::vector<Img> inf_species_rasts = state_storage.copies(I_species_rast, run_batch_size);
+    std::vector<Img> resistant_rasts = state_storage.zeros(rows, cols, run_batch_size);
 
     // We always create at least one exposed for simplicity, but we
     // could also just leave it empty.
-    std::vector<std::vector<Img>> exposed_vectors(
-                num_runs,
-                std::vector<Img>(
-                    config.latency_period_steps + 1,
-                    Img(S_species_rast.rows(), S_species_rast.cols(), 0)
-                    )
-                );
+    std::vector<std::vector<Img>> exposed_vectors;
+    exposed_vectors.reserve(run_batch_size);
+    for (unsigned i = 0; i < run_batch_size; ++i)
+        exposed_vectors.push_back(
+                    state_storage.zeros(rows, cols, config.latency_period_steps + 1));
 
     // infected cohort for each year (index is cohort age)
     // age starts with 0 (in year 1), 0 is oldest
-    std::vector<std::vector<Img> > mortality_tracker_vector(
-        num_runs, std::vector<Img>(config.num_mortality_years(), Img(S_species_rast, 0)));
+    std::vector<std::vector<Img> > mortality_tracker_vector;
+    mortality_tracker_vector.reserve(run_batch_size);
+    for (unsigned i = 0; i < run_batch_size; ++i)
+        mortality_tracker_vector.push_back(
+                    state_storage.zeros(rows, cols, config.num_mortality_years()));
 
     // we are using only the first dead img for visualization, but for
     // parallelization we need all allocated anyway
-    std::vector<Img> dead_in_current_year(num_runs, Img(S_species_rast, 0));
+    std::vector<Img> dead_in_current_year = state_storage.zeros(rows, cols, run_batch_size);
     // dead trees accumulated over years
     // TODO: allow only when series as single run
-    Img accumulated_dead(Img(S_species_rast, 0));
-
-    models.reserve(num_runs);
-    dispersers.reserve(num_runs);
-    for (unsigned i = 0; i < num_runs; ++i) {
+    std::vector<Img> accumulated_dead(scenarios.size(), Img(S_species_rast, 0));
+
+    // streams for chunks are derived from the seed, so they don't
+    // depend on how many runs and chunks were simulated before
+    unsigned first_seed = seed_value;
+    bool chunk_streams = opt.random_streams->answer == string("chunk");
+    // checkpoint does not contain state of the generators, but with
+    // chunk streams, the state is given by the step where it continues
+    if ((opt.checkpoint->answer || opt.restart->answer) && !chunk_streams)
+        G_fatal_error(_("Options %s and %s require %s=chunk"),
+                      opt.checkpoint->key, opt.restart->key,
+                      opt.random_streams->key);
+    models.reserve(run_batch_size);
+    dispersers.reserve(run_batch_size);
+    for (unsigned i = 0; i < run_batch_size; ++i) {
         Config config_copy = config;
-        config_copy.random_seed = seed_value++;
+        config_copy.random_seed = first_seed + i % runs_per_scenario;
         models.emplace_back(config_copy);
         dispersers.emplace_back(I_species_rast.rows(), I_species_rast.cols());
     }
+    // outside dispersers and spread rates are kept for all runs
     std::vector<std::vector<std::tuple<int, int> > > outside_spores(num_runs);
+    // runs which have no suspectible hosts left
+    // (char, not bool, so that runs can be updated from different threads)
+    std::vector<char> run_finished(run_batch_size, false);
+    // Without susceptible hosts, state and outputs of a run stay the same
+    // only in the SI model without mortality, treatments, and lethal
+    // temperature and when dispersers leaving the region and spread rate
+    // are not needed, otherwise all steps are simulated.
+    bool stop_finished_runs = config.model_type == "SI" && !config.use_mortality
+            && !config.use_treatments && !config.use_lethal_temperature
+            && !opt.outside_spores->answer && !opt.spread_rate_output->answer;
+    std::unique_ptr<MeanFieldModel> mean_field_model;
+    if (mean_field)
+        mean_field_model.reset(new MeanFieldModel(
+                                   config, I_species_rast, S_species_rast,
+                                   lvtree_rast, threads));
 
     // spread rate initialization
     std::vector<SpreadRate<Img>> spread_rates(num_runs,
@@ -997,172 +1832,615 @@ int main(int argc, char *argv[])
     // Unused movements
     std::vector<std::vector<int>> movements;
 
-    std::vector<unsigned> unresolved_steps;
-    unresolved_steps.reserve(config.scheduler().get_num_steps());
 
-    // main simulation loop
-    unsigned current_index = 0;
-    for (; current_index < config.scheduler().get_num_steps(); ++current_index) {
-        unresolved_steps.push_back(current_index);
+    // runs fork at the beginning of the step with the fork date
+    unsigned fork_step = 0;
+    if (opt.fork_date->answer) {
+        Date fork_date = treatment_date_from_string(opt.fork_date->answer);
+        unsigned num_steps = config.scheduler().get_num_steps();
+        while (fork_step < num_steps
+               && config.scheduler().get_step(fork_step).end_date() < fork_date)
+            ++fork_step;
+        if (fork_step >= num_steps)
+            G_fatal_error(_("Date <%s> (%s) is after the end of the simulation"),
+                          opt.fork_date->answer, opt.fork_date->key);
+        // only the first run (of the first scenario) is simulated
+        // before the fork, so its treatments apply to all scenarios
+        Date fork_start = config.scheduler().get_step(fork_step).start_date();
+        auto treatments_before_fork = [&fork_start](const Scenario& scenario) {
+            std::vector<std::tuple<string, int, int, int, unsigned, string>> items;
+            for (size_t i = 0; i < scenario.treatments.size(); ++i) {
+                Date date = treatment_date_from_string(scenario.treatment_dates[i]);
+                if (date < fork_start)
+                    items.emplace_back(scenario.treatments[i], date.year(),
+                                       date.month(), date.day(),
+                                       scenario.treatment_lengths[i],
+                                       scenario.treatment_application);
+            }
+            return items;
+        };
+        for (const auto& scenario : scenarios)
+            if (treatments_before_fork(scenario) != treatments_before_fork(scenarios[0]))
+                G_fatal_error(_("Treatments before %s must be the same in all"
+                                " scenarios, scenario <%s> differs from <%s>"),
+                              opt.fork_date->key, scenario.name.c_str(),
+                              scenarios[0].name.c_str());
+        split_batches_at(batches, fork_step);
+    }
 
-        // if all the hosts are infected, then exit
-        if (all_infected(S_species_rast)) {
-            G_warning("In step %d all suspectible hosts are infected, ending simulation.", current_index);
-            break;
+    // spread rates of steps before restart (pops-core spread rate
+    // cannot be restored, so these are kept separately)
+    std::vector<std::vector<double>> restored_rates(num_runs);
+    // extent of infection at the last spread rate step which the next
+    // rate is computed from (needed only for checkpoints)
+    std::vector<InfectionExtent> rate_extents;
+    if (opt.checkpoint->answer)
+        rate_extents.assign(num_runs, infection_extent(I_species_rast));
+    unsigned restored_rate_steps = 0;
+    auto num_rate_steps = [&config](unsigned last_step) {
+        const std::vector<bool>& schedule = config.spread_rate_schedule();
+        unsigned count = 0;
+        for (unsigned step = 0; step <= last_step && step < schedule.size(); ++step)
+            count += schedule[step];
+        return count;
+    };
+    // all runs continue from the state of the first one
+    auto fork_runs = [&]() {
+        for (unsigned run = 1; run < num_runs; ++run) {
+            copy_raster_values(inf_species_rasts[0], inf_species_rasts[run]);
+            copy_raster_values(sus_species_rasts[0], sus_species_rasts[run]);
+            copy_raster_values(resistant_rasts[0], resistant_rasts[run]);
+            for (size_t i = 0; i < exposed_vectors[0].size(); ++i)
+                copy_raster_values(exposed_vectors[0][i], exposed_vectors[run][i]);
+            for (size_t i = 0; i < mortality_tracker_vector[0].size(); ++i)
+                copy_raster_values(mortality_tracker_vector[0][i],
+                                   mortality_tracker_vector[run][i]);
+            outside_spores[run] = outside_spores[0];
+            spread_rates[run] = spread_rates[0];
+            restored_rates[run] = restored_rates[0];
+            if (!rate_extents.empty())
+                rate_extents[run] = rate_extents[0];
+            run_finished[run] = run_finished[0];
         }
-
-        // check whether the spore occurs in the month
-        // At the end of the year, run simulation for all unresolved
-        // steps in one chunk.
-        if (config.output_schedule()[current_index] || current_index == config.scheduler().get_num_steps() - 1) {
-            unsigned step_in_chunk = 0;
-            // get weather for all the steps in chunk
-            for (auto step : unresolved_steps) {
-                if (moisture_temperature) {
-                    DImg moisture(raster_from_grass_float(moisture_names[step]));
-                    DImg temperature(raster_from_grass_float(temperature_names[step]));
-                    weather_coefficients[step_in_chunk] = moisture * temperature;
-                } else if (weather)
-                    weather_coefficients[step_in_chunk] = raster_from_grass_float(weather_names[step]);
-                ++step_in_chunk;
+    };
+    // the same code writes and reads checkpoints, so the order matches,
+    // a checkpoint with one run can be read for any number of runs
+    auto transfer_checkpoint = [&](CheckpointStream& stream, uint32_t& next_step) {
+        uint32_t stored_runs = num_runs;
+        stream.value(stored_runs);
+        if (stored_runs != num_runs && stored_runs != 1)
+            G_fatal_error(_("Checkpoint file <%s> was created with"
+                            " different number of runs"), opt.restart->answer);
+        stream.check<uint32_t>(config.scheduler().get_num_steps(),
+                               "number of steps");
+        stream.check<uint32_t>(first_seed, "random seed");
+        stream.value(next_step);
+        stream.values(run_finished);
+        run_finished.resize(num_runs, false);
+        unsigned rate_steps = next_step ? num_rate_steps(next_step - 1) : 0;
+        for (unsigned run = 0; run < stored_runs; ++run) {
+            stream.raster(inf_species_rasts[run]);
+            stream.raster(sus_species_rasts[run]);
+            stream.raster(resistant_rasts[run]);
+            stream.rasters(exposed_vectors[run]);
+            stream.rasters(mortality_tracker_vector[run]);
+            checkpoint_cells(stream, outside_spores[run]);
+            std::vector<double> rates;
+            if (stream.writing()) {
+                for (unsigned i = 0; i < rate_steps; ++i) {
+                    double n, s, e, w;
+                    if (i < restored_rate_steps)
+                        std::tie(n, s, e, w) = std::make_tuple(
+                                    restored_rates[run][4 * i],
+                                    restored_rates[run][4 * i + 1],
+                                    restored_rates[run][4 * i + 2],
+                                    restored_rates[run][4 * i + 3]);
+                    else
+                        std::tie(n, s, e, w) = spread_rates[run].step_rate(i);
+                    rates.insert(rates.end(), {n, s, e, w});
+                }
             }
+            stream.values(rates);
+            if (!stream.writing())
+                restored_rates[run] = rates;
+            InfectionExtent extent = stream.writing() ? rate_extents[run]
+                                                      : InfectionExtent();
+            stream.value(extent);
+            if (!stream.writing()) {
+                // rebuilt so that the next rate uses the stored extent
+                Img raster = infection_extent_raster(extent, rows, cols);
+                spread_rates[run] = SpreadRate<Img>(
+                            raster, window.ew_res, window.ns_res,
+                            config.rate_num_steps());
+                for (unsigned i = 0; i < rate_steps; ++i)
+                    spread_rates[run].compute_step_spread_rate(raster, i);
+                if (!rate_extents.empty())
+                    rate_extents[run] = extent;
+            }
+        }
+        stream.rasters(accumulated_dead);
+        if (!stream.writing())
+            restored_rate_steps = rate_steps;
+        return stored_runs;
+    };
 
-            // stochastic simulation runs
-            #pragma omp parallel for num_threads(threads)
-            for (unsigned run = 0; run < num_runs; run++) {
-                // actual runs of the simulation for each step
-                int weather_step = 0;
-                for (auto step : unresolved_steps) {
-                    dead_in_current_year[run].zero();
-                    models[run].run_step(
-                                step,
-                                inf_species_rasts[run],
-                                sus_species_rasts[run],
-                                lvtree_rast,
-                                dispersers[run],
-                                exposed_vectors[run],
-                                mortality_tracker_vector[run],
-                                dead_in_current_year[run],
-                                actual_temperatures,
-                                weather_coefficients[weather_step],
-                                treatments,
-                                resistant_rasts[run],
-                                outside_spores[run],
-                                spread_rates[run],
-                                quarantine,
-                                empty,
-                                movements
-                                );
-                    ++weather_step;
+    // continue after the step where the checkpoint was written
+    unsigned current_index = 0;
+    unsigned first_batch = 0;
+    if (opt.restart->answer) {
+        CheckpointStream stream(opt.restart->answer,
+                                CheckpointStream::Mode::Read);
+        uint32_t next_step = 0;
+        unsigned stored_runs = transfer_checkpoint(stream, next_step);
+        stream.close();
+        while (first_batch < batches.size()
+               && batches[first_batch].steps.front() < next_step)
+            ++first_batch;
+        if (first_batch < batches.size()
+                && batches[first_batch].steps.front() != next_step)
+            G_fatal_error(_("Checkpoint file <%s> does not match the"
+                            " simulation steps"), opt.restart->answer);
+        if (next_step)
+            current_index = next_step - 1;
+        if (stored_runs < num_runs)
+            fork_runs();
+        G_verbose_message(_("Continuing from step %u of checkpoint <%s>"),
+                          next_step, opt.restart->answer);
+    }
+    // only the first run is simulated and used for outputs before fork
+    unsigned active_runs = num_runs;
+    if (first_batch < batches.size()
+            && batches[first_batch].steps.front() < fork_step)
+        active_runs = 1;
+    std::vector<Img> fork_prefix_run;
+    fork_prefix_run.emplace_back(inf_species_rasts[0].data(), rows, cols);
+    // runs of each scenario for outputs (when all runs are in memory)
+    std::vector<std::vector<Img>> scenario_infected(scenarios.size());
+    if (!run_batches) {
+        for (unsigned scenario = 0; scenario < scenarios.size(); ++scenario) {
+            scenario_infected[scenario].reserve(runs_per_scenario);
+            for (unsigned i = 0; i < runs_per_scenario; ++i)
+                scenario_infected[scenario].emplace_back(
+                            inf_species_rasts[scenario * runs_per_scenario + i].data(),
+                            rows, cols);
+        }
+    }
+    // statistics accumulated over batches of runs for each scenario,
+    // series by step
+    std::map<unsigned, std::vector<RunningStatistics<StatisticsImg>>> series_statistics;
+    std::vector<RunningStatistics<StatisticsImg>> final_statistics;
+    if (run_batches)
+        final_statistics.assign(
+                    scenarios.size(),
+                    RunningStatistics<StatisticsImg>(rows, cols, opt.average->answer,
+                                            opt.stddev->answer,
+                                            opt.probability->answer));
+    unsigned checkpoint_frequency = 1;
+    if (opt.checkpoint_frequency_n->answer)
+        checkpoint_frequency = std::stoul(opt.checkpoint_frequency_n->answer);
+    unsigned num_outputs = 0;
+
+    // weather for the next batch is read while the current one is
+    // simulated, so the buffer holds two batches (or all steps)
+    WeatherReader weather_reader(weather_names, moisture_names, temperature_names);
+    WeatherBuffer weather_buffer(
+                weather_reader.enabled() ? weather_slots() : 0,
+                config.rows, config.cols);
+    if (weather_reader.enabled())
+        G_verbose_message(_("Weather buffer for %u steps uses %.1f MiB"),
+                          weather_buffer.capacity(),
+                          weather_buffer.memory() / (1024. * 1024.));
+    WeatherPrefetcher weather_prefetcher(weather_reader, weather_buffer);
+
+    // series are written in background while the simulation continues,
+    // at most one output step is waiting to be written
+    OutputWriter output_writer(num_series);
+    // statistics series are written from the runs or accumulated statistics
+    auto write_statistics_series = [&](unsigned scenario, const Step& interval,
+                                       StatisticsImg&& average_raster,
+                                       StatisticsImg&& stddev,
+                                       StatisticsImg&& probability, double area) {
+        if (opt.stddev_series->answer) {
+            string name = generate_name(
+                        scenario_output_name(opt.stddev_series->answer,
+                                             scenarios[scenario]),
+                        interval.end_date());
+            string title = "Standard deviation of average"
+                           " occurrence from all stochastic runs";
+            output_writer.write_raster(std::move(stddev), name, title,
+                                       interval.end_date());
+        }
+        if (opt.average_series->answer) {
+            // write result
+            // date is always end of the year, even for seasonal spread
+            string name = generate_name(
+                        scenario_output_name(opt.average_series->answer,
+                                             scenarios[scenario]),
+                        interval.end_date());
+            Date date = interval.end_date();
+            auto average = std::make_shared<StatisticsImg>(std::move(average_raster));
+            output_writer.push([average, name, date, area]() {
+                raster_to_grass(*average, name,
+                                "Average occurrence from all stochastic runs",
+                                date);
+                write_average_area(area, name.c_str());
+            });
+        }
+        if (opt.probability_series->answer) {
+            string name = generate_name(
+                        scenario_output_name(opt.probability_series->answer,
+                                             scenarios[scenario]),
+                        interval.end_date());
+            string title = "Probability of occurrence";
+            output_writer.write_raster(std::move(probability), name, title,
+                                       interval.end_date());
+        }
+    };
+
+    // runs take turns by decreasing time of their previous batch, so
+    // expensive runs start first and cheap ones fill the remaining time
+    std::vector<unsigned> run_order(run_batch_size);
+    for (unsigned run = 0; run < run_batch_size; ++run)
+        run_order[run] = run;
+    std::vector<double> run_time(run_batch_size, 0);
+
+    // batches of runs (one batch with all runs by default)
+    for (unsigned run_batch_start = 0; run_batch_start < num_runs;
+         run_batch_start += run_batch_size) {
+        unsigned batch_runs = std::min(run_batch_size, num_runs - run_batch_start);
+        if (run_batch_start) {
+            // next batch starts from the initial state
+            for (unsigned run = 0; run < batch_runs; ++run) {
+                state_storage.restore(sus_species_rasts[run], S_species_rast);
+                state_storage.restore(inf_species_rasts[run], I_species_rast);
+                state_storage.reset(resistant_rasts[run]);
+                for (auto& exposed : exposed_vectors[run])
+                    state_storage.reset(exposed);
+                for (auto& cohort : mortality_tracker_vector[run])
+                    state_storage.reset(cohort);
+                state_storage.reset(dead_in_current_year[run]);
+                Config run_config = config;
+                run_config.random_seed =
+                        first_seed + (run_batch_start + run) % runs_per_scenario;
+                models[run] = Model<Img, DImg, int>(run_config);
+                run_finished[run] = false;
+            }
+            std::lock_guard<std::mutex> lock(grass_mutex());
+            G_verbose_message(_("Simulating runs %u to %u"),
+                              run_batch_start + 1, run_batch_start + batch_runs);
+        }
+        // weather of all steps is read only for the first batch of runs
+        if (run_batch_start && weather_resident)
+            weather_prefetcher.replay();
+        if (first_batch < batches.size())
+            weather_prefetcher.request(batches[first_batch].steps);
+
+        // main simulation loop
+        for (unsigned batch = first_batch; batch < batches.size(); ++batch) {
+            const std::vector<unsigned>& batch_steps = batches[batch].steps;
+            ProfileTimer weather_timer(profile, "weather waiting");
+            unsigned first_weather_slot = weather_prefetcher.take();
+            weather_timer.stop();
+
+            bool forked = false;
+            if (batch_steps.front() == fork_step && active_runs < num_runs) {
+                fork_runs();
+                active_runs = num_runs;
+                forked = true;
+            }
+            unsigned simulated_runs = std::min(active_runs, batch_runs);
+            if (batch + 1 < batches.size())
+                weather_prefetcher.request(batches[batch + 1].steps);
+            current_index = batch_steps.back();
+            // forked runs continue with their own streams from the fork step
+            bool starts_chunk = batch == 0 || batches[batch - 1].ends_chunk || forked;
+
+            ProfileTimer simulation_timer(profile, "simulation");
+            if (mean_field_model) {
+                // one deterministic simulation instead of the runs
+                unsigned weather_slot = first_weather_slot;
+                for (auto step : batch_steps)
+                    mean_field_model->run_step(step, weather_buffer[weather_slot++]);
+            }
+            else {
+                // stochastic simulation runs for all steps in the batch
+                std::stable_sort(run_order.begin(), run_order.end(),
+                                 [&run_time](unsigned a, unsigned b) {
+                                     return run_time[a] > run_time[b];
+                                 });
+                #pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+                for (unsigned i = 0; i < run_batch_size; i++) {
+                    unsigned run = run_order[i];
+                    if (run >= simulated_runs)
+                        continue;
+                    // index of the run among all runs
+                    unsigned global_run = run_batch_start + run;
+                    auto start = std::chrono::steady_clock::now();
+                    if (chunk_streams && starts_chunk) {
+                        Config run_config = config;
+                        run_config.random_seed = stream_seed(
+                                    first_seed, global_run % runs_per_scenario,
+                                    batch_steps.front());
+                        models[run] = Model<Img, DImg, int>(run_config);
+                    }
+                    // actual runs of the simulation for each step
+                    unsigned weather_slot = first_weather_slot;
+                    double generated = 0;
+                    for (auto step : batch_steps) {
+                        state_storage.reset(dead_in_current_year[run]);
+                        // run without suspectible hosts is not simulated further,
+                        // its state is still used for the outputs
+                        if (run_finished[run])
+                            break;
+                        models[run].run_step(
+                                    step,
+                                    inf_species_rasts[run],
+                                    sus_species_rasts[run],
+                                    lvtree_rast,
+                                    dispersers[run],
+                                    exposed_vectors[run],
+                                    mortality_tracker_vector[run],
+                                    dead_in_current_year[run],
+                                    actual_temperatures,
+                                    weather_buffer[weather_slot],
+                                    *scenario_treatments[global_run / runs_per_scenario],
+                                    resistant_rasts[run],
+                                    outside_spores[global_run],
+                                    spread_rates[global_run],
+                                    quarantine,
+                                    empty,
+                                    movements
+                                    );
+                        ++weather_slot;
+                        if (!rate_extents.empty() && config.spread_rate_schedule()[step])
+                            rate_extents[global_run] =
+                                    infection_extent(inf_species_rasts[run]);
+                        // dispersers raster holds dispersers from the last
+                        // spread step, so it is counted only after spread steps
+                        if (profile.enabled() && config.spread_schedule()[step])
+                            dispersers[run].for_each([&generated](Integer value) {
+                                generated += value;
+                            });
+                        // scans cells until the first one with susceptible hosts
+                        if (stop_finished_runs)
+                            run_finished[run] = all_infected(sus_species_rasts[run]);
+                    }
+                    std::chrono::duration<double> duration =
+                            std::chrono::steady_clock::now() - start;
+                    run_time[run] = duration.count();
+                    profile.add_count("dispersers generated", generated);
                 }
+                std::vector<double> times;
+                for (unsigned run = 0; run < simulated_runs; ++run)
+                    times.push_back(run_time[run]);
+                profile.add_run_times(batch_steps.front(), times);
             }
+            simulation_timer.stop();
 
-            unresolved_steps.clear();
-            if (config.output_schedule()[current_index]) {
+            if (batches[batch].ends_chunk && config.output_schedule()[current_index]) {
                 // output
+                // writer owns copies of the rasters, so the runs can continue
                 Step interval = config.scheduler().get_step(current_index);
-                if (opt.single_series->answer) {
-                    string name = generate_name(opt.single_series->answer, interval.end_date());
-                    raster_to_grass(inf_species_rasts[0], name,
-                            "Occurrence from a single stochastic run",
-                            interval.end_date());
-                }
-                if ((opt.average_series->answer) || opt.stddev_series->answer) {
-                    // aggregate in the series
-                    DImg average_raster(I_species_rast.rows(), I_species_rast.cols(), 0);
-                    average_raster.zero();
-                    for (unsigned i = 0; i < num_runs; i++)
-                        average_raster += inf_species_rasts[i];
-                    average_raster /= num_runs;
-                    if (opt.average_series->answer) {
-                        // write result
-                        // date is always end of the year, even for seasonal spread
-                        string name = generate_name(opt.average_series->answer, interval.end_date());
-                        raster_to_grass(average_raster, name,
-                                        "Average occurrence from all stochastic runs",
-                                        interval.end_date());
-                        write_average_area(inf_species_rasts, name.c_str(),
-                                           window.ew_res, window.ns_res);
+                for (unsigned scenario = 0; scenario < scenarios.size(); ++scenario) {
+                    unsigned first_run = active_runs < num_runs ? 0 : scenario * runs_per_scenario;
+                    // first run of the scenario may be in another batch of runs
+                    bool has_first_run = first_run >= run_batch_start
+                            && first_run < run_batch_start + batch_runs;
+                    unsigned first_batch_run = first_run - run_batch_start;
+                    if (opt.single_series->answer && has_first_run) {
+                        string name = generate_name(
+                                    scenario_output_name(opt.single_series->answer,
+                                                         scenarios[scenario]),
+                                    interval.end_date());
+                        output_writer.write_raster(inf_species_rasts[first_batch_run], name,
+                                                   "Occurrence from a single stochastic run",
+                                                   interval.end_date());
                     }
-                    if (opt.stddev_series->answer) {
-                        DImg stddev(I_species_rast.rows(), I_species_rast.cols(), 0);
-                        for (unsigned i = 0; i < num_runs; i++) {
-                            auto tmp = inf_species_rasts[i] - average_raster;
-                            stddev += tmp * tmp;
-                        }
-                        stddev /= num_runs;
-                        stddev.for_each([](Float& a){a = std::sqrt(a);});
-                        string name = generate_name(opt.stddev_series->answer, interval.end_date());
-                        string title = "Standard deviation of average"
-                                       " occurrence from all stochastic runs";
-                        raster_to_grass(stddev, name, title, interval.end_date());
+                    if ((opt.average_series->answer || opt.stddev_series->answer
+                            || opt.probability_series->answer) && run_batches) {
+                        // accumulate runs of the scenario, written at the end
+                        ProfileTimer statistics_timer(profile, "statistics");
+                        auto& statistics = series_statistics[current_index];
+                        if (statistics.empty())
+                            statistics.assign(
+                                        scenarios.size(),
+                                        RunningStatistics<StatisticsImg>(
+                                            rows, cols, opt.average_series->answer,
+                                            opt.stddev_series->answer,
+                                            opt.probability_series->answer));
+                        for (unsigned run = 0; run < batch_runs; ++run)
+                            if ((run_batch_start + run) / runs_per_scenario == scenario)
+                                statistics[scenario].add(inf_species_rasts[run], threads);
                     }
-                }
-                if (opt.probability_series->answer) {
-                    DImg probability(I_species_rast.rows(), I_species_rast.cols(), 0);
-                    for (unsigned i = 0; i < num_runs; i++) {
-                        Img tmp = inf_species_rasts[i];
-                        tmp.for_each([](Integer& a){a = bool(a);});
-                        probability += tmp;
+                    else if (opt.average_series->answer || opt.stddev_series->answer
+                            || opt.probability_series->answer) {
+                        const std::vector<Img>& output_runs =
+                                active_runs < num_runs ? fork_prefix_run : scenario_infected[scenario];
+                        // aggregate in the series
+                        StatisticsImg average_raster;
+                        StatisticsImg stddev;
+                        StatisticsImg probability;
+                        if (opt.average_series->answer)
+                            average_raster = StatisticsImg(rows, cols);
+                        if (opt.stddev_series->answer)
+                            stddev = StatisticsImg(rows, cols);
+                        if (opt.probability_series->answer)
+                            probability = StatisticsImg(rows, cols);
+                        ProfileTimer statistics_timer(profile, "statistics");
+                        simulation_statistics(
+                                    mean_field_model.get(),
+                                    output_runs,
+                                    opt.average_series->answer ? &average_raster : nullptr,
+                                    opt.stddev_series->answer ? &stddev : nullptr,
+                                    opt.probability_series->answer ? &probability : nullptr,
+                                    threads);
+                        double area = 0;
+                        if (opt.average_series->answer)
+                            area = mean_field_model
+                                    ? mean_field_model->infected_area(window.ew_res, window.ns_res)
+                                    : average_infected_area(output_runs,
+                                                            window.ew_res, window.ns_res);
+                        statistics_timer.stop();
+                        write_statistics_series(scenario, interval,
+                                                std::move(average_raster),
+                                                std::move(stddev),
+                                                std::move(probability), area);
                     }
-                    probability *= 100;  // prob from 0 to 100
-                    probability /= num_runs;
-                    string name = generate_name(opt.probability_series->answer, interval.end_date());
-                    string title = "Probability of occurrence";
-                    raster_to_grass(probability, name, title, interval.end_date());
-                }
-                if (config.use_mortality && opt.dead_series->answer) {
-                    accumulated_dead += dead_in_current_year[0];
-                    if (opt.dead_series->answer) {
-                        string name = generate_name(opt.dead_series->answer, interval.end_date());
-                        raster_to_grass(accumulated_dead, name,
-                                        "Number of dead hosts to date",
+                    if (config.use_mortality && opt.dead_series->answer && has_first_run) {
+                        accumulated_dead[scenario] += dead_in_current_year[first_batch_run];
+                        if (opt.dead_series->answer) {
+                            string name = generate_name(
+                                        scenario_output_name(opt.dead_series->answer,
+                                                             scenarios[scenario]),
                                         interval.end_date());
+                            output_writer.write_raster(accumulated_dead[scenario], name,
+                                                       "Number of dead hosts to date",
+                                                       interval.end_date());
+                        }
                     }
                 }
+                // no need to continue from the last step
+                ++num_outputs;
+                if (opt.checkpoint->answer && num_outputs % checkpoint_frequency == 0
+                        && batch + 1 < batches.size()) {
+                    ProfileTimer checkpoint_timer(profile, "checkpoint writing");
+                    CheckpointStream stream(opt.checkpoint->answer,
+                                            CheckpointStream::Mode::Write);
+                    uint32_t next_step = current_index + 1;
+                    transfer_checkpoint(stream, next_step);
+                    stream.close();
+                    checkpoint_timer.stop();
+                    std::lock_guard<std::mutex> lock(grass_mutex());
+                    G_verbose_message(_("Checkpoint written after step %u"),
+                                      current_index);
+                }
             }
         }
+        if (run_batches) {
+            ProfileTimer statistics_timer(profile, "statistics");
+            for (unsigned run = 0; run < batch_runs; ++run)
+                final_statistics[(run_batch_start + run) / runs_per_scenario].add(
+                            inf_species_rasts[run], threads);
+        }
+        if (profile.enabled() && !mean_field_model) {
+            double infected_cells = 0;
+            for (unsigned run = 0; run < std::min(active_runs, batch_runs); ++run)
+                inf_species_rasts[run].for_each([&infected_cells](Integer value) {
+                    if (value > 0)
+                        ++infected_cells;
+                });
+            profile.add_count("infected cells in all runs", infected_cells);
+        }
     }
-    Step interval = config.scheduler().get_step(--current_index);
-    if (opt.average->answer || opt.stddev->answer) {
-        // aggregate
-        DImg average_raster(I_species_rast.rows(), I_species_rast.cols(), 0);
-        for (unsigned i = 0; i < num_runs; i++)
-            average_raster += inf_species_rasts[i];
-        average_raster /= num_runs;
-        if (opt.average->answer) {
-            // write final result
-            raster_to_grass(average_raster, opt.average->answer,
-                            "Average occurrence from all stochastic runs",
-                            interval.end_date());
-            write_average_area(inf_species_rasts, opt.average->answer,
-                               window.ew_res, window.ns_res);
+    // series accumulated over batches of runs
+    for (const auto& item : series_statistics) {
+        Step interval = config.scheduler().get_step(item.first);
+        for (unsigned scenario = 0; scenario < scenarios.size(); ++scenario) {
+            StatisticsImg average_raster;
+            StatisticsImg stddev;
+            StatisticsImg probability;
+            if (opt.average_series->answer)
+                average_raster = StatisticsImg(rows, cols);
+            if (opt.stddev_series->answer)
+                stddev = StatisticsImg(rows, cols);
+            if (opt.probability_series->answer)
+                probability = StatisticsImg(rows, cols);
+            const auto& statistics = item.second[scenario];
+            statistics.get(opt.average_series->answer ? &average_raster : nullptr,
+                           opt.stddev_series->answer ? &stddev : nullptr,
+                           opt.probability_series->answer ? &probability : nullptr);
+            write_statistics_series(scenario, interval,
+                                    std::move(average_raster),
+                                    std::move(stddev), std::move(probability),
+                                    statistics.average_nonzero_cells()
+                                    * window.ew_res * window.ns_res);
         }
-        if (opt.stddev->answer) {
-            DImg stddev(average_raster.rows(), average_raster.cols(), 0);
-            for (unsigned i = 0; i < num_runs; i++) {
-                auto tmp = inf_species_rasts[i] - average_raster;
-                stddev += tmp * tmp;
+    }
+    series_statistics.clear();
+    // everything else is written from this thread
+    weather_prefetcher.wait();
+    {
+        ProfileTimer writer_timer(profile, "series writing waiting");
+        output_writer.finish();
+    }
+    profile.add_time("weather reading", weather_prefetcher.read_time());
+    profile.add_time("series writing", output_writer.busy_time());
+
+    G_verbose_message(_("Exposed, mortality and other sparse rasters of all"
+                        " runs use %.1f MiB out of %.1f MiB"),
+                      state_storage.zeros_resident() / (1024. * 1024.),
+                      state_storage.zeros_allocated() / (1024. * 1024.));
+
+    Step interval = config.scheduler().get_step(current_index);
+    for (unsigned scenario = 0; scenario < scenarios.size(); ++scenario) {
+        if (opt.average->answer || opt.stddev->answer || opt.probability->answer) {
+            // aggregate
+            StatisticsImg average_raster;
+            StatisticsImg stddev;
+            StatisticsImg probability;
+            if (opt.average->answer)
+                average_raster = StatisticsImg(rows, cols);
+            if (opt.stddev->answer)
+                stddev = StatisticsImg(rows, cols);
+            if (opt.probability->answer)
+                probability = StatisticsImg(rows, cols);
+            ProfileTimer statistics_timer(profile, "statistics");
+            double area = 0;
+            if (run_batches) {
+                final_statistics[scenario].get(
+                            opt.average->answer ? &average_raster : nullptr,
+                            opt.stddev->answer ? &stddev : nullptr,
+                            opt.probability->answer ? &probability : nullptr);
+                area = final_statistics[scenario].average_nonzero_cells()
+                        * window.ew_res * window.ns_res;
+            }
+            else {
+                const std::vector<Img>& output_runs =
+                        active_runs < num_runs ? fork_prefix_run : scenario_infected[scenario];
+                simulation_statistics(mean_field_model.get(), output_runs,
+                                      opt.average->answer ? &average_raster : nullptr,
+                                      opt.stddev->answer ? &stddev : nullptr,
+                                      opt.probability->answer ? &probability : nullptr,
+                                      threads);
+                if (opt.average->answer)
+                    area = mean_field_model
+                            ? mean_field_model->infected_area(window.ew_res, window.ns_res)
+                            : average_infected_area(output_runs,
+                                                    window.ew_res, window.ns_res);
+            }
+            statistics_timer.stop();
+            ProfileTimer output_timer(profile, "output writing");
+            if (opt.average->answer) {
+                // write final result
+                string name = scenario_output_name(opt.average->answer,
+                                                   scenarios[scenario]);
+                raster_to_grass(average_raster, name,
+                                "Average occurrence from all stochastic runs",
+                                interval.end_date());
+                write_average_area(area, name.c_str());
+            }
+            if (opt.stddev->answer) {
+                raster_to_grass(stddev,
+                                scenario_output_name(opt.stddev->answer,
+                                                     scenarios[scenario]),
+                                opt.stddev->description, interval.end_date());
+            }
+            if (opt.probability->answer) {
+                raster_to_grass(probability,
+                                scenario_output_name(opt.probability->answer,
+                                                     scenarios[scenario]),
+                                "Probability of occurrence", interval.end_date());
             }
-            stddev /= num_runs;
-            stddev.for_each([](Float& a){a = std::sqrt(a);});
-            raster_to_grass(stddev, opt.stddev->answer,
-                            opt.stddev->description, interval.end_date());
         }
     }
-    if (opt.probability->answer) {
-        DImg probability(I_species_rast.rows(), I_species_rast.cols(), 0);
-        for (unsigned i = 0; i < num_runs; i++) {
-            Img tmp = inf_species_rasts[i];
-            tmp.for_each([](Integer& a){a = bool(a);});
-            probability += tmp;
-        }
-        probability *= 100;  // prob from 0 to 100
-        probability /= num_runs;
-        raster_to_grass(probability, opt.probability->answer,
-                        "Probability of occurrence", interval.end_date());
+    if (profile.enabled() && !mean_field_model) {
+        double outside = 0;
+        for (const auto& cells : outside_spores)
+            outside += cells.size();
+        profile.add_count("dispersers landed outside", outside);
     }
     if (opt.outside_spores->answer) {
+        ProfileTimer vector_timer(profile, "outside dispersers writing");
         Cell_head region;
         Rast_get_window(&region);
         struct Map_info Map;
@@ -1183,7 +2461,10 @@ int main(int argc, char *argv[])
                 Vect_reset_line(Points);
                 Vect_reset_cats(Cats);
                 Vect_append_point(Points, e, n, 0);
-                Vect_cat_set(Cats, 1, i + 1);
+                // run within scenario in layer 1, scenario in layer 2
+                Vect_cat_set(Cats, 1, i % runs_per_scenario + 1);
+                if (opt.scenario_file->answer)
+                    Vect_cat_set(Cats, 2, i / runs_per_scenario + 1);
                 Vect_write_line(&Map, GV_POINT, Points, Cats);
             }
         }
@@ -1202,21 +2483,42 @@ int main(int argc, char *argv[])
         Vect_destroy_cats_struct(Cats);
     }
     if (opt.spread_rate_output->answer) {
+        ProfileTimer rate_timer(profile, "spread rate writing");
         FILE *fp = G_open_option_file(opt.spread_rate_output);
+        // scenario column only when there are named scenarios
+        if (opt.scenario_file->answer)
+            fprintf(fp, "scenario,");
         fprintf(fp, "year,N,S,E,W\n");
-        for (unsigned step = 0; step < config.scheduler().get_num_steps(); step++) {
-            double n, s, e, w;
-            if (config.spread_rate_schedule()[step]) {
-                unsigned i = simulation_step_to_action_step(config.spread_rate_schedule(), step);
-                std::tie(n, s, e, w) = average_spread_rate(spread_rates, i);
-                int year = config.scheduler().get_step(step).end_date().year();
-                fprintf(fp, "%d,%.0f,%.0f,%.0f,%.0f\n", year,
-                        isnan(n) ? n : round(n), isnan(s) ? s : round(s),
-                        isnan(e) ? e : round(e), isnan(w) ? w : round(w));
+        for (unsigned scenario = 0; scenario < scenarios.size(); ++scenario) {
+            // averages over runs of the scenario
+            auto first = scenario * runs_per_scenario;
+            auto last = first + runs_per_scenario;
+            std::vector<SpreadRate<Img>> rates(spread_rates.begin() + first,
+                                               spread_rates.begin() + last);
+            std::vector<std::vector<double>> stored(restored_rates.begin() + first,
+                                                    restored_rates.begin() + last);
+            for (unsigned step = 0; step < config.scheduler().get_num_steps(); step++) {
+                double n, s, e, w;
+                if (config.spread_rate_schedule()[step]) {
+                    unsigned i = simulation_step_to_action_step(config.spread_rate_schedule(), step);
+                    if (i < restored_rate_steps)
+                        std::tie(n, s, e, w) = average_restored_rate(stored, i);
+                    else
+                        std::tie(n, s, e, w) = average_spread_rate(rates, i);
+                    int year = config.scheduler().get_step(step).end_date().year();
+                    if (opt.scenario_file->answer)
+                        fprintf(fp, "%s,", scenarios[scenario].name.c_str());
+                    fprintf(fp, "%d,%.0f,%.0f,%.0f,%.0f\n", year,
+                            isnan(n) ? n : round(n), isnan(s) ? s : round(s),
+                            isnan(e) ? e : round(e), isnan(w) ? w : round(w));
+                }
             }
         }
         G_close_option_file(fp);
     }
+    if (opt.profile->answer)
+        profile.write(opt.profile->answer);
+    profile.report();
 
     return 0;
 }
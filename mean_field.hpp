@@ -0,0 +1,303 @@
+/*
+ * PoPS model - Deterministic expected-value (mean-field) simulation
+ *
+ * Copyright (C) 2021 by the authors.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef MEAN_FIELD_HPP
+#define MEAN_FIELD_HPP
+
+#include "graster.hpp"
+#include "kernel_table.hpp"
+
+#include "pops/model.hpp"
+
+extern "C" {
+#include <grass/gmath.h>
+}
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <tuple>
+#include <vector>
+
+/** Deterministic simulation of the expected state of the SI model
+ *
+ * Instead of drawing individual dispersers, each step computes the
+ * expected number of dispersers from each cell (infected times
+ * reproductive rate times weather) and spreads them by convolution with
+ * the dispersal kernel table (natural and anthropogenic kernels mixed
+ * by percentage of natural dispersal). The convolution is computed by
+ * FFT on a grid padded by the kernel radius, so dispersers leaving the
+ * computational region are lost as in the stochastic simulation.
+ *
+ * Like in the stochastic simulation, weather of the source cell scales
+ * both the number of dispersers and their establishment. Each host is
+ * hit by Poisson-distributed number of established dispersers, so
+ * the expected new infections in a cell are S (1 - exp(-L / N)) where
+ * L is the expected number of landing dispersers, S the susceptible
+ * and N the total number of hosts.
+ *
+ * Besides the expected number of infected hosts (corresponding to
+ * the average of stochastic runs), the probability that a cell is
+ * infected is tracked assuming the infections in a step arrive
+ * independently from the previous state of the cell.
+ *
+ * Only spread in the SI model is included (no latency, treatments,
+ * mortality, or lethal temperature).
+ *
+ * The cell-wise parts of a step are computed by row bands in parallel
+ * using the given number of threads.
+ */
+class MeanFieldModel
+{
+public:
+    MeanFieldModel(const pops::Config& config,
+                   const Img& infected,
+                   const Img& susceptible,
+                   const Img& total_plants,
+                   unsigned num_threads = 1)
+        : num_threads_(num_threads ? num_threads : 1),
+          rows_(config.rows),
+          cols_(config.cols),
+          reproductive_rate_(config.reproductive_rate),
+          weather_(config.weather),
+          spread_schedule_(config.spread_schedule()),
+          infected_(rows_, cols_),
+          susceptible_(rows_, cols_),
+          probability_(rows_, cols_),
+          hosts_(rows_, cols_),
+          total_plants_(rows_, cols_),
+          dispersers_(rows_, cols_)
+    {
+        for (int i = 0; i < rows_; ++i) {
+            for (int j = 0; j < cols_; ++j) {
+                infected_(i, j) = infected(i, j);
+                susceptible_(i, j) = susceptible(i, j);
+                probability_(i, j) = infected(i, j) > 0 ? 1 : 0;
+                hosts_(i, j) = infected(i, j) + susceptible(i, j);
+                total_plants_(i, j) = total_plants(i, j);
+            }
+        }
+        create_kernel(config);
+    }
+
+    /** Simulate one step, weather is used only if enabled in config */
+    void run_step(unsigned step, const DImg& weather)
+    {
+        if (!spread_schedule_[step])
+            return;
+        #pragma omp parallel for num_threads(num_threads_) schedule(static)
+        for (int i = 0; i < rows_; ++i) {
+            for (int j = 0; j < cols_; ++j) {
+                double coefficient = weather_ ? weather(i, j) : 1;
+                // number of dispersers and their establishment
+                dispersers_(i, j) = infected_(i, j) * reproductive_rate_
+                        * coefficient * coefficient;
+            }
+        }
+        convolve(dispersers_);
+        #pragma omp parallel for num_threads(num_threads_) schedule(static)
+        for (int i = 0; i < rows_; ++i) {
+            for (int j = 0; j < cols_; ++j) {
+                if (total_plants_(i, j) <= 0)
+                    continue;
+                double landed = std::max(0.0, dispersers_(i, j));
+                double hits = landed / total_plants_(i, j);
+                double infections = susceptible_(i, j) * (1 - std::exp(-hits));
+                susceptible_(i, j) -= infections;
+                infected_(i, j) += infections;
+                double arrival = hosts_(i, j) * hits;
+                probability_(i, j) = 1 - (1 - probability_(i, j)) * std::exp(-arrival);
+            }
+        }
+    }
+
+    /** Expected number of infected hosts */
+    const StatisticsImg& infected() const
+    {
+        return infected_;
+    }
+
+    /** Probability that a cell is infected (0 to 1) */
+    const StatisticsImg& probability() const
+    {
+        return probability_;
+    }
+
+    /** Expected area of infected cells */
+    double infected_area(double ew_res, double ns_res) const
+    {
+        double area = 0;
+        #pragma omp parallel for num_threads(num_threads_) reduction(+:area)
+        for (int i = 0; i < rows_; ++i)
+            for (int j = 0; j < cols_; ++j)
+                area += probability_(i, j);
+        return area * ew_res * ns_res;
+    }
+
+    /** Radius (in cells) of the kernel table and of the padding */
+    static int kernel_radius(const pops::Config& config)
+    {
+        const double tail = 0.001;
+        int radius = DispersalKernelTable::radius_for_tail(
+                    natural_distribution(config), config.ew_res,
+                    config.ns_res, tail);
+        if (config.use_anthropogenic_kernel)
+            radius = std::max(radius,
+                              DispersalKernelTable::radius_for_tail(
+                                  anthropogenic_distribution(config),
+                                  config.ew_res, config.ns_res, tail));
+        // no need to reach further than across the region
+        return std::min(radius, std::max(config.rows, config.cols));
+    }
+
+    /** Memory in bytes used by the model at most
+     *
+     * Includes the rasters, the padded grids of the convolution (with
+     * the copy made by fft2()), and the kernel tables which exist while
+     * the kernel spectrum is created.
+     */
+    static double memory(const pops::Config& config)
+    {
+        double cells = double(config.rows) * config.cols;
+        double radius = kernel_radius(config);
+        double padded = (config.rows + radius) * (config.cols + radius);
+        double table = (2 * radius + 1) * (2 * radius + 1);
+        // natural, mixed, and anthropogenic
+        unsigned num_tables = config.use_anthropogenic_kernel ? 3 : 2;
+        return (6 * cells + num_tables * table) * sizeof(double)
+                + 3 * padded * sizeof(Complex);
+    }
+
+private:
+    typedef std::array<double, 2> Complex;
+
+    static RadialKernelDistribution natural_distribution(const pops::Config& config)
+    {
+        return RadialKernelDistribution(
+                    pops::kernel_type_from_string(config.natural_kernel_type),
+                    config.natural_scale,
+                    pops::direction_from_string(config.natural_direction),
+                    config.natural_kappa);
+    }
+
+    static RadialKernelDistribution anthropogenic_distribution(const pops::Config& config)
+    {
+        return RadialKernelDistribution(
+                    pops::kernel_type_from_string(config.anthro_kernel_type),
+                    config.anthro_scale,
+                    pops::direction_from_string(config.anthro_direction),
+                    config.anthro_kappa);
+    }
+
+    /** Forward (-1) or inverse (1) FFT of the padded grid in place */
+    void fft(int sign, std::vector<Complex>& data)
+    {
+        // array of two doubles has the layout of double[2]
+        fft2(sign, reinterpret_cast<double (*)[2]>(data.data()),
+             data.size(), padded_cols_, padded_rows_);
+    }
+
+    /** Spectrum of the mixed kernel on the padded grid */
+    void create_kernel(const pops::Config& config)
+    {
+        RadialKernelDistribution natural = natural_distribution(config);
+        int radius = kernel_radius(config);
+        double natural_weight = 1;
+        std::vector<RadialKernelDistribution> anthropogenic;
+        if (config.use_anthropogenic_kernel) {
+            anthropogenic.push_back(anthropogenic_distribution(config));
+            natural_weight = config.percent_natural_dispersal;
+        }
+        DispersalKernelTable natural_table(natural, config.ew_res,
+                                           config.ns_res, radius);
+        std::vector<double> kernel = natural_table.probabilities();
+        for (auto& value : kernel)
+            value *= natural_weight;
+        if (!anthropogenic.empty()) {
+            DispersalKernelTable table(anthropogenic[0], config.ew_res,
+                                       config.ns_res, radius);
+            const auto& probabilities = table.probabilities();
+            for (size_t i = 0; i < kernel.size(); ++i)
+                kernel[i] += (1 - natural_weight) * probabilities[i];
+        }
+
+        // padding keeps the wrap-around of the circular convolution
+        // outside of the region
+        padded_rows_ = rows_ + radius;
+        padded_cols_ = cols_ + radius;
+        size_t size = size_t(padded_rows_) * padded_cols_;
+        spectrum_.assign(size, {{0, 0}});
+        work_.resize(size);
+        for (size_t i = 0; i < kernel.size(); ++i) {
+            int row;
+            int col;
+            std::tie(row, col) = natural_table.offset(i);
+            // negative offsets wrap around
+            row = (row + padded_rows_) % padded_rows_;
+            col = (col + padded_cols_) % padded_cols_;
+            spectrum_[size_t(row) * padded_cols_ + col][0] = kernel[i];
+        }
+        fft(-1, spectrum_);
+        // fft2() scales both directions by 1/sqrt(size)
+        double scale = std::sqrt(double(size));
+        for (auto& value : spectrum_) {
+            value[0] *= scale;
+            value[1] *= scale;
+        }
+    }
+
+    /** Replace values by their convolution with the kernel */
+    void convolve(StatisticsImg& values)
+    {
+        std::fill(work_.begin(), work_.end(), Complex{{0, 0}});
+        #pragma omp parallel for num_threads(num_threads_) schedule(static)
+        for (int i = 0; i < rows_; ++i)
+            for (int j = 0; j < cols_; ++j)
+                work_[size_t(i) * padded_cols_ + j][0] = values(i, j);
+        fft(-1, work_);
+        long size = work_.size();
+        #pragma omp parallel for num_threads(num_threads_) schedule(static)
+        for (long i = 0; i < size; ++i) {
+            double real = work_[i][0] * spectrum_[i][0]
+                    - work_[i][1] * spectrum_[i][1];
+            double imaginary = work_[i][0] * spectrum_[i][1]
+                    + work_[i][1] * spectrum_[i][0];
+            work_[i][0] = real;
+            work_[i][1] = imaginary;
+        }
+        fft(1, work_);
+        #pragma omp parallel for num_threads(num_threads_) schedule(static)
+        for (int i = 0; i < rows_; ++i)
+            for (int j = 0; j < cols_; ++j)
+                values(i, j) = work_[size_t(i) * padded_cols_ + j][0];
+    }
+
+    unsigned num_threads_;
+    int rows_;
+    int cols_;
+    double reproductive_rate_;
+    bool weather_;
+    std::vector<bool> spread_schedule_;
+    StatisticsImg infected_;
+    StatisticsImg susceptible_;
+    StatisticsImg probability_;
+    StatisticsImg hosts_;
+    StatisticsImg total_plants_;
+    StatisticsImg dispersers_;
+    int padded_rows_{0};
+    int padded_cols_{0};
+    std::vector<Complex> spectrum_;
+    std::vector<Complex> work_;
+};
+
+#endif // MEAN_FIELD_HPP
@@ -0,0 +1,135 @@
+/*
+ * PoPS model - Writing outputs in background
+ *
+ * Copyright (C) 2021 by the authors.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef OUTPUT_WRITER_HPP
+#define OUTPUT_WRITER_HPP
+
+#include "graster.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/** Writes outputs on a separate thread
+ *
+ * Tasks are functions which own everything they need to write, so the
+ * simulation can continue modifying its state after a task is queued.
+ * Each task holds grass_mutex() while running.
+ *
+ * The queue is bounded. When writing is slower than the simulation,
+ * push() blocks, so there are never more than *max_queued* snapshots
+ * waiting in memory.
+ */
+class OutputWriter
+{
+public:
+    explicit OutputWriter(unsigned max_queued)
+        : max_queued_(max_queued ? max_queued : 1),
+          thread_(&OutputWriter::run, this)
+    {}
+
+    ~OutputWriter()
+    {
+        finish();
+    }
+
+    /** Queue a task, block while the queue is full */
+    void push(std::function<void()> task)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this]() {
+            return queue_.size() < max_queued_;
+        });
+        queue_.push_back(std::move(task));
+        changed_.notify_all();
+    }
+
+    /** Queue writing of a raster map with title and date
+     *
+     * The raster is moved into the task, so pass a copy when the
+     * original is still needed.
+     */
+    template<typename Number>
+    void write_raster(pops::Raster<Number> raster,
+                      const std::string& name,
+                      const std::string& title,
+                      const pops::Date& date)
+    {
+        auto snapshot = std::make_shared<pops::Raster<Number>>(
+                    std::move(raster));
+        push([snapshot, name, title, date]() {
+            raster_to_grass(*snapshot, name, title, date);
+        });
+    }
+
+    /** Total wall time of writing in seconds (complete after finish()) */
+    double busy_time() const
+    {
+        return busy_time_;
+    }
+
+    /** Write everything queued and stop the writing thread
+     *
+     * No tasks can be queued afterwards.
+     */
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            finished_ = true;
+            changed_.notify_all();
+        }
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+private:
+    void run()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [this]() {
+                    return !queue_.empty() || finished_;
+                });
+                if (queue_.empty())
+                    return;
+                task = std::move(queue_.front());
+                queue_.pop_front();
+                changed_.notify_all();
+            }
+            std::lock_guard<std::mutex> grass_lock(grass_mutex());
+            auto start = std::chrono::steady_clock::now();
+            task();
+            std::chrono::duration<double> duration =
+                    std::chrono::steady_clock::now() - start;
+            busy_time_ += duration.count();
+        }
+    }
+
+    unsigned max_queued_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<std::function<void()>> queue_;
+    bool finished_{false};
+    double busy_time_{0};
+    std::thread thread_;
+};
+
+#endif // OUTPUT_WRITER_HPP
@@ -0,0 +1,196 @@
+/*
+ * PoPS model - Time of simulation phases and counters
+ *
+ * Copyright (C) 2021 by the authors.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+extern "C" {
+#include <grass/gis.h>
+#include <grass/glocale.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/** Wall time of phases, time of runs in chunks, and counters
+ *
+ * Phases and counters are reported in the order in which they were
+ * first recorded. Adding is thread-safe. When disabled, nothing is
+ * recorded, so the calls can stay in the code.
+ */
+class Profile
+{
+public:
+    explicit Profile(bool enabled)
+        : enabled_(enabled)
+    {}
+
+    bool enabled() const
+    {
+        return enabled_;
+    }
+
+    /** Add wall time in seconds to a phase */
+    void add_time(const std::string& phase, double seconds)
+    {
+        if (!enabled_)
+            return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        Item& item = find(phases_, phase);
+        item.value += seconds;
+        ++item.calls;
+    }
+
+    /** Add to a counter */
+    void add_count(const std::string& counter, double value)
+    {
+        if (!enabled_)
+            return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        Item& item = find(counters_, counter);
+        item.value += value;
+        ++item.calls;
+    }
+
+    /** Record times of runs simulating one chunk starting at a step */
+    void add_run_times(unsigned step, std::vector<double> times)
+    {
+        if (!enabled_ || times.empty())
+            return;
+        std::sort(times.begin(), times.end());
+        double median = times.size() % 2
+                ? times[times.size() / 2]
+                : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2;
+        std::lock_guard<std::mutex> lock(mutex_);
+        chunks_.push_back({step, times.front(), median, times.back()});
+    }
+
+    /** Write everything as JSON to a file (- for standard output) */
+    void write(const char* filename) const
+    {
+        FILE* fp = std::string(filename) == "-" ? stdout : fopen(filename, "w");
+        if (!fp)
+            G_fatal_error(_("Unable to open file <%s> for writing"), filename);
+        fprintf(fp, "{\n  \"phases\": {");
+        for (size_t i = 0; i < phases_.size(); ++i)
+            fprintf(fp, "%s\n    \"%s\": {\"seconds\": %.6f, \"calls\": %lu}",
+                    i ? "," : "", phases_[i].name.c_str(), phases_[i].value,
+                    phases_[i].calls);
+        fprintf(fp, "\n  },\n  \"counters\": {");
+        for (size_t i = 0; i < counters_.size(); ++i)
+            fprintf(fp, "%s\n    \"%s\": %.0f", i ? "," : "",
+                    counters_[i].name.c_str(), counters_[i].value);
+        fprintf(fp, "\n  },\n  \"chunks\": [");
+        for (size_t i = 0; i < chunks_.size(); ++i)
+            fprintf(fp, "%s\n    {\"step\": %u, \"run_seconds_min\": %.6f,"
+                    " \"run_seconds_median\": %.6f, \"run_seconds_max\": %.6f}",
+                    i ? "," : "", chunks_[i].step, chunks_[i].min,
+                    chunks_[i].median, chunks_[i].max);
+        fprintf(fp, "\n  ]\n}\n");
+        if (fp != stdout && fclose(fp) != 0)
+            G_fatal_error(_("Unable to write file <%s>"), filename);
+    }
+
+    /** Print a summary as verbose messages */
+    void report() const
+    {
+        for (const auto& phase : phases_)
+            G_verbose_message(_("Time of %s: %.3f s (%lu times)"),
+                              phase.name.c_str(), phase.value, phase.calls);
+        for (const auto& counter : counters_)
+            G_verbose_message(_("Number of %s: %.0f"),
+                              counter.name.c_str(), counter.value);
+        if (chunks_.empty())
+            return;
+        double min = chunks_.front().min;
+        double max = chunks_.front().max;
+        for (const auto& chunk : chunks_) {
+            min = std::min(min, chunk.min);
+            max = std::max(max, chunk.max);
+        }
+        G_verbose_message(_("Time of one run in a chunk: %.3f s to %.3f s"
+                            " in %lu chunks"), min, max, chunks_.size());
+    }
+
+private:
+    struct Item
+    {
+        std::string name;
+        double value;
+        unsigned long calls;
+    };
+
+    struct Chunk
+    {
+        unsigned step;
+        double min;
+        double median;
+        double max;
+    };
+
+    static Item& find(std::vector<Item>& items, const std::string& name)
+    {
+        for (auto& item : items)
+            if (item.name == name)
+                return item;
+        items.push_back({name, 0, 0});
+        return items.back();
+    }
+
+    bool enabled_;
+    std::mutex mutex_;
+    std::vector<Item> phases_;
+    std::vector<Item> counters_;
+    std::vector<Chunk> chunks_;
+};
+
+/** Adds wall time from its creation to stop() or destruction to a phase */
+class ProfileTimer
+{
+public:
+    ProfileTimer(Profile& profile, const std::string& phase)
+        : profile_(profile), phase_(phase),
+          start_(std::chrono::steady_clock::now())
+    {}
+
+    ProfileTimer(const ProfileTimer&) = delete;
+    ProfileTimer& operator=(const ProfileTimer&) = delete;
+
+    ~ProfileTimer()
+    {
+        stop();
+    }
+
+    /** Add the time now instead of at destruction */
+    void stop()
+    {
+        if (stopped_)
+            return;
+        stopped_ = true;
+        std::chrono::duration<double> duration =
+                std::chrono::steady_clock::now() - start_;
+        profile_.add_time(phase_, duration.count());
+    }
+
+private:
+    Profile& profile_;
+    std::string phase_;
+    std::chrono::steady_clock::time_point start_;
+    bool stopped_{false};
+};
+
+#endif // PROFILE_HPP
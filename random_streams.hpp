@@ -0,0 +1,43 @@
+/*
+ * PoPS model - Counter-based seeds for random number streams
+ *
+ * Copyright (C) 2021 by the authors.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef RANDOM_STREAMS_HPP
+#define RANDOM_STREAMS_HPP
+
+#include <cstdint>
+
+/** Bijective mixing of 64 bits (SplitMix64 finalizer) */
+inline uint64_t mix_bits(uint64_t value)
+{
+    value = (value ^ (value >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    value = (value ^ (value >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return value ^ (value >> 31);
+}
+
+/** Seed of a random number stream given by a seed, run, and step
+ *
+ * The seed is a function of the key only (counter-based), so a stream
+ * can be created for any run and step without generating the previous
+ * ones and without any state shared between threads. Different keys
+ * give unrelated streams, unlike consecutive seeds where runs of one
+ * seed overlap with runs of the next seed.
+ */
+inline unsigned stream_seed(unsigned seed, unsigned run, unsigned step)
+{
+    // golden ratio increment as in SplitMix64, so that zero is not fixed
+    uint64_t value = mix_bits(seed + UINT64_C(0x9e3779b97f4a7c15));
+    value = mix_bits(value ^ (uint64_t(run) << 32 | step));
+    return static_cast<unsigned>(value >> 32);
+}
+
+#endif // RANDOM_STREAMS_HPP
@@ -0,0 +1,243 @@
+/*
+ * PoPS model - Copy-on-write storage for rasters of individual runs
+ *
+ * Copyright (C) 2021 by the authors.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef RASTER_STORAGE_HPP
+#define RASTER_STORAGE_HPP
+
+extern "C" {
+#include <grass/gis.h>
+#include <grass/glocale.h>
+}
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RASTER_STORAGE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/** Storage for rasters of individual runs which start in the same state
+ *
+ * The initial state is written once to a temporary file and each copy
+ * is a private memory mapping of that file. All copies share the pages
+ * of the file until a copy modifies a page, then only that page is
+ * copied by the operating system (copy-on-write). Rasters which start
+ * as zeros are anonymous mappings, so their pages are not allocated
+ * at all until modified.
+ *
+ * The pages of a mapping work as tiles of a sparse raster: zero pages
+ * of layers such as exposed or dead hosts are not allocated until
+ * written, so the memory use depends on how many pages the simulation
+ * writes to rather than on the size of the computational region.
+ * Use reset() instead of zeroing the raster to keep it that way.
+ *
+ * The rasters are non-owning views of the mappings which are valid
+ * as long as the storage exists.
+ *
+ * When memory mapping is not available (RASTER_STORAGE_MMAP is not
+ * defined), the rasters are ordinary copies.
+ */
+template<typename Raster>
+class CopyOnWriteStorage
+{
+public:
+    typedef typename Raster::NumberType Number;
+
+    CopyOnWriteStorage() = default;
+    CopyOnWriteStorage(const CopyOnWriteStorage&) = delete;
+    CopyOnWriteStorage& operator=(const CopyOnWriteStorage&) = delete;
+
+    ~CopyOnWriteStorage()
+    {
+#ifdef RASTER_STORAGE_MMAP
+        for (const auto& mapping : mappings_)
+            munmap(mapping.first, mapping.second);
+#endif
+    }
+
+    /** Create rasters with the same content as *initial* */
+    std::vector<Raster> copies(const Raster& initial, unsigned count)
+    {
+        std::vector<Raster> rasters;
+        rasters.reserve(count);
+#ifdef RASTER_STORAGE_MMAP
+        size_t bytes = raster_bytes(initial.rows(), initial.cols());
+        if (bytes) {
+            int fd = shared_file(initial.data(), bytes);
+            for (unsigned i = 0; i < count; ++i) {
+                Number* data = map(fd, bytes);
+                copy_mappings_[data] = bytes;
+                rasters.emplace_back(data, initial.rows(), initial.cols());
+            }
+            close(fd);
+            return rasters;
+        }
+#endif
+        for (unsigned i = 0; i < count; ++i)
+            rasters.emplace_back(initial);
+        return rasters;
+    }
+
+    /** Create rasters filled with zeros */
+    std::vector<Raster> zeros(unsigned rows, unsigned cols, unsigned count)
+    {
+        std::vector<Raster> rasters;
+        rasters.reserve(count);
+#ifdef RASTER_STORAGE_MMAP
+        size_t bytes = raster_bytes(rows, cols);
+        if (bytes) {
+            for (unsigned i = 0; i < count; ++i) {
+                Number* data = map(-1, bytes);
+                zero_mappings_[data] = bytes;
+                rasters.emplace_back(data, rows, cols);
+            }
+            return rasters;
+        }
+#endif
+        for (unsigned i = 0; i < count; ++i)
+            rasters.emplace_back(rows, cols, 0);
+        return rasters;
+    }
+
+    /** Set all values of a raster to zero
+     *
+     * For rasters created by zeros(), the memory is returned to the
+     * operating system (on Linux), so the raster does not use memory
+     * until it is modified again. Other rasters are zeroed as usual.
+     * This can be called for different rasters from different threads.
+     */
+    void reset(Raster& raster) const
+    {
+#if defined(RASTER_STORAGE_MMAP) && defined(__linux__)
+        auto mapping = zero_mappings_.find(raster.data());
+        if (mapping != zero_mappings_.end()) {
+            // private anonymous pages read as zeros after this
+            if (madvise(mapping->first, mapping->second, MADV_DONTNEED) == 0)
+                return;
+        }
+#endif
+        raster.zero();
+    }
+
+    /** Set values of a raster created by copies() back to *initial*
+     *
+     * Modified pages are returned to the operating system (on Linux),
+     * so the raster shares the initial state with other copies again.
+     * Other rasters are copied as usual.
+     */
+    void restore(Raster& raster, const Raster& initial) const
+    {
+#if defined(RASTER_STORAGE_MMAP) && defined(__linux__)
+        auto mapping = copy_mappings_.find(raster.data());
+        if (mapping != copy_mappings_.end()) {
+            // private file pages read from the file after this
+            if (madvise(mapping->first, mapping->second, MADV_DONTNEED) == 0)
+                return;
+        }
+#endif
+        std::copy(initial.data(),
+                  initial.data() + size_t(initial.rows()) * initial.cols(),
+                  raster.data());
+    }
+
+    /** Memory in bytes allocated for rasters created by zeros() */
+    size_t zeros_allocated() const
+    {
+        size_t bytes = 0;
+        for (const auto& mapping : zero_mappings_)
+            bytes += mapping.second;
+        return bytes;
+    }
+
+    /** Memory in bytes actually used by rasters created by zeros()
+     *
+     * Only pages which were modified are counted (on Linux),
+     * elsewhere this is the same as zeros_allocated().
+     */
+    size_t zeros_resident() const
+    {
+#if defined(RASTER_STORAGE_MMAP) && defined(__linux__)
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t bytes = 0;
+        std::vector<unsigned char> pages;
+        for (const auto& mapping : zero_mappings_) {
+            pages.resize((mapping.second + page_size - 1) / page_size);
+            if (mincore(mapping.first, mapping.second, pages.data()) != 0)
+                return zeros_allocated();
+            for (auto page : pages)
+                if (page & 1)
+                    bytes += page_size;
+        }
+        return bytes;
+#else
+        return zeros_allocated();
+#endif
+    }
+
+private:
+    static size_t raster_bytes(unsigned rows, unsigned cols)
+    {
+        return sizeof(Number) * rows * cols;
+    }
+
+#ifdef RASTER_STORAGE_MMAP
+    /** Create private mapping of a file or anonymous one for fd -1 */
+    Number* map(int fd, size_t bytes)
+    {
+        int flags = MAP_PRIVATE;
+        if (fd < 0)
+            flags |= MAP_ANONYMOUS;
+        void* data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, fd, 0);
+        if (data == MAP_FAILED)
+            G_fatal_error(_("Unable to map %lu bytes of memory"),
+                          (unsigned long) bytes);
+        mappings_.emplace_back(data, bytes);
+        return static_cast<Number*>(data);
+    }
+
+    /** Write data to an unlinked temporary file, return its descriptor */
+    static int shared_file(const Number* data, size_t bytes)
+    {
+        char* name = G_tempfile();
+        int fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            G_fatal_error(_("Unable to create temporary file <%s>"), name);
+        // the file is removed once the last mapping is gone
+        unlink(name);
+        G_free(name);
+        const char* buffer = reinterpret_cast<const char*>(data);
+        size_t written = 0;
+        while (written < bytes) {
+            ssize_t result = write(fd, buffer + written, bytes - written);
+            if (result < 0)
+                G_fatal_error(_("Unable to write to temporary file"));
+            written += result;
+        }
+        return fd;
+    }
+
+    std::vector<std::pair<void*, size_t>> mappings_;
+#endif
+    // anonymous mappings by their address
+    std::map<void*, size_t> zero_mappings_;
+    // mappings of the initial state by their address
+    std::map<void*, size_t> copy_mappings_;
+};
+
+#endif // RASTER_STORAGE_HPP
@@ -0,0 +1,188 @@
+/*
+ * Test of precomputed dispersal kernel tables
+ *
+ * Copyright (C) 2021 by the authors.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/*
+ * Compares probabilities of DispersalKernelTable with frequencies of
+ * landing cells drawn from the continuous kernel distribution and
+ * rounded to cells the same way as in the engine. Build from the module
+ * directory and run, non-zero exit status means failure:
+ *
+ *   c++ -std=c++11 -Ipops-core/include -I. \
+ *       testsuite/test_kernel_table.cpp -o test_kernel_table
+ *   ./test_kernel_table
+ *
+ * Landing cells are compared only where dispersers from the tail
+ * cannot land, i.e., closer than the tail distance minus the rounding
+ * to cells. Everything else is compared as one outer area which gets
+ * the tail probability and the table probabilities of its cells.
+ */
+
+#include "kernel_table.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <tuple>
+#include <vector>
+
+namespace {
+
+const double ew_res = 10;
+const double ns_res = 12;
+/* allowed difference in standard errors, the seeds are fixed */
+const double tolerance = 5;
+/* allowed relative difference of a cell given by assigning parts of
+ * rings to cells by their middle in the table */
+const double discretization = 0.25;
+/* allowed relative difference of the whole area the table covers */
+const double area_discretization = 0.01;
+
+/** Landing cells relative to the source which the tail cannot reach */
+class Areas
+{
+public:
+    explicit Areas(const DispersalKernelTable& table)
+        : radius_(table.radius()), is_inner_(table.probabilities().size())
+    {
+        double rounding = std::hypot(ew_res, ns_res) / 2;
+        const auto& probabilities = table.probabilities();
+        for (size_t i = 0; i < probabilities.size(); ++i) {
+            int row;
+            int col;
+            std::tie(row, col) = table.offset(i);
+            if (std::hypot(row * ns_res, col * ew_res)
+                    < table.tail_distance() - rounding) {
+                inner_.push_back(i);
+                is_inner_[i] = true;
+            }
+            else {
+                outer_probability_ += probabilities[i];
+            }
+        }
+        outer_probability_ += table.tail_probability();
+    }
+
+    /** Indices of probabilities() which only the table can reach */
+    const std::vector<size_t>& inner() const
+    {
+        return inner_;
+    }
+
+    /** Probability of landing anywhere else */
+    double outer_probability() const
+    {
+        return outer_probability_;
+    }
+
+    /** Index to probabilities() or -1 for the outer area */
+    long index(int row, int col) const
+    {
+        if (std::abs(row) > radius_ || std::abs(col) > radius_)
+            return -1;
+        long i = (row + radius_) * (2 * radius_ + 1) + (col + radius_);
+        return is_inner_[i] ? i : -1;
+    }
+
+private:
+    int radius_;
+    std::vector<bool> is_inner_;
+    std::vector<size_t> inner_;
+    double outer_probability_{0};
+};
+
+bool check_count(const char* what, long index, double observed,
+                 double expected, double standard_error, double relative)
+{
+    if (std::abs(observed - expected) <= tolerance * standard_error
+            + relative * expected + 1e-9)
+        return true;
+    std::fprintf(stderr, "%s at offset index %ld: %g, expected %g (+- %g)\n",
+                 what, index, observed, expected, standard_error);
+    return false;
+}
+
+/** Angle for given value of the cumulative distribution (by bisection) */
+double angle_quantile(const RadialKernelDistribution& distribution,
+                      double probability)
+{
+    double low = 0;
+    double high = 2 * M_PI;
+    for (unsigned i = 0; i < 50; ++i) {
+        double middle = (low + high) / 2;
+        if (distribution.angle_cdf(middle) < probability)
+            low = middle;
+        else
+            high = middle;
+    }
+    return (low + high) / 2;
+}
+
+/** Table and tail probabilities match frequencies of drawn landings */
+bool check_table(const RadialKernelDistribution& distribution,
+                 const DispersalKernelTable& table)
+{
+    Areas areas(table);
+    std::mt19937 generator(42);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    const unsigned draws = 2000000;
+    std::map<long, unsigned> counts;
+    for (unsigned i = 0; i < draws; ++i) {
+        double distance = distribution.distance_quantile(uniform(generator));
+        double theta = angle_quantile(distribution, uniform(generator));
+        int row = -std::round(distance * std::cos(theta) / ns_res);
+        int col = std::round(distance * std::sin(theta) / ew_res);
+        ++counts[areas.index(row, col)];
+    }
+    bool ok = true;
+    double total = table.tail_probability();
+    for (auto p : table.probabilities())
+        total += p;
+    if (std::abs(total - 1) > 1e-6) {
+        std::fprintf(stderr, "Probabilities sum to %g\n", total);
+        ok = false;
+    }
+    for (auto i : areas.inner()) {
+        double p = table.probabilities()[i];
+        ok &= check_count("Frequency", i, counts[i], draws * p,
+                          std::sqrt(draws * p * (1 - p)), discretization);
+    }
+    double p = areas.outer_probability();
+    ok &= check_count("Frequency outside", -1, counts[-1], draws * p,
+                      std::sqrt(draws * p * (1 - p)), area_discretization);
+    return ok;
+}
+
+}  // namespace
+
+int main()
+{
+    bool ok = true;
+    RadialKernelDistribution exponential(pops::DispersalKernelType::Exponential,
+                                         30, pops::Direction::W, 2);
+    DispersalKernelTable exponential_table(
+                exponential, ew_res, ns_res,
+                DispersalKernelTable::radius_for_tail(exponential, ew_res,
+                                                      ns_res, 0.01));
+    ok &= check_table(exponential, exponential_table);
+
+    RadialKernelDistribution cauchy(pops::DispersalKernelType::Cauchy,
+                                    20, pops::Direction::None, 0);
+    DispersalKernelTable cauchy_table(cauchy, ew_res, ns_res, 8);
+    ok &= check_table(cauchy, cauchy_table);
+
+    if (!ok)
+        return 1;
+    std::printf("Kernel tables match the kernel distributions\n");
+    return 0;
+}
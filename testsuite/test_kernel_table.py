@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+
+"""Test of precomputed dispersal kernel tables.
+
+Compiles and runs test_kernel_table.cpp which compares the table
+probabilities with frequencies drawn from the kernel distribution.
+"""
+
+import os
+import shutil
+import subprocess
+import tempfile
+
+from grass.gunittest.case import TestCase
+from grass.gunittest.main import test
+
+
+class TestKernelTable(TestCase):
+
+    def test_table_probabilities(self):
+        testsuite = os.path.dirname(os.path.abspath(__file__))
+        module = os.path.dirname(testsuite)
+        compiler = shutil.which(os.environ.get('CXX', 'c++'))
+        pops_core = os.path.join(module, 'pops-core', 'include')
+        if not compiler or not os.path.isdir(pops_core):
+            self.skipTest("C++ compiler or pops-core headers not available")
+        directory = tempfile.mkdtemp()
+        try:
+            program = os.path.join(directory, 'test_kernel_table')
+            subprocess.check_call([compiler, '-std=c++11', '-O2',
+                                   '-I' + pops_core, '-I' + module,
+                                   os.path.join(testsuite, 'test_kernel_table.cpp'),
+                                   '-o', program])
+            result = subprocess.run([program], stdout=subprocess.PIPE,
+                                    stderr=subprocess.PIPE, universal_newlines=True)
+            self.assertEqual(result.returncode, 0, msg=result.stderr)
+        finally:
+            shutil.rmtree(directory)
+
+
+if __name__ == '__main__':
+    test()
@@ -6,9 +6,13 @@
 .. moduleauthor:: Vaclav Petras
 """
 
+import json
+import re
+
 from grass.gunittest.case import TestCase
 from grass.gunittest.main import test
 from grass.gunittest.gmodules import call_module
+import grass.script as gs
 
 
 class TestSpread(TestCase):
@@ -128,6 +132,362 @@ class TestSpread(TestCase):
         self.assertRasterFitsUnivar(raster='stddev', reference=values, precision=0.001)
 
 
+    def test_parallel_input_reading(self):
+        """Check that reading inputs with multiple threads gives the same outputs"""
+        version = re.match(r'(\d+)\.(\d+)', gs.version()['version'])
+        if (int(version.group(1)), int(version.group(2))) < (8, 3):
+            self.skipTest("Parallel reading of inputs requires GRASS GIS 8.3 or later")
+        parameters = dict(host='host', total_plants='max_host', infected='infection',
+                          start_date='2019-01-01', end_date='2022-12-31',
+                          seasonality=[1, 12], step_unit='week', step_num_units=1,
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          anthropogenic_dispersal_kernel='cauchy', anthropogenic_distance=1000,
+                          anthropogenic_direction_strength=0, percent_natural_dispersal=0.95,
+                          random_seed=1, runs=5, nprocs=5)
+        self.assertModule('r.pops.spread', average='average_1', stddev='stddev_1',
+                          probability='probability_1', nprocs_io=1, **parameters)
+        self.assertModule('r.pops.spread', average='average_4', stddev='stddev_4',
+                          probability='probability_4', nprocs_io=4, **parameters)
+        for name in ('average', 'stddev', 'probability'):
+            self.assertRastersNoDifference(actual=name + '_4', reference=name + '_1',
+                                           precision=0)
+
+    def test_mean_field(self):
+        """Check that mean-field mode approximates average and probability of many runs
+
+        Means over the region of the mean-field outputs need to be within
+        25 % of the means of 50 stochastic runs.
+        """
+        parameters = dict(host='host', total_plants='max_host', infected='infection',
+                          start_date='2019-01-01', end_date='2019-12-31',
+                          seasonality=[1, 12], step_unit='week', step_num_units=1,
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          random_seed=1)
+        self.assertModule('r.pops.spread', average='average', probability='probability',
+                          simulation_mode='mean_field', **parameters)
+        self.assertModule('r.pops.spread', average='average_runs', probability='probability_runs',
+                          runs=50, nprocs=4, **parameters)
+        self.assertRasterMinMax('probability', refmin=0, refmax=100)
+        tolerance = 0.25
+        for name in ['average', 'probability']:
+            mean_field = gs.parse_command('r.univar', map=name, flags='g')
+            runs = gs.parse_command('r.univar', map=name + '_runs', flags='g')
+            expected = float(runs['mean'])
+            self.assertGreater(expected, 0)
+            self.assertAlmostEqual(float(mean_field['mean']), expected,
+                                   delta=tolerance * expected,
+                                   msg="Mean of {} differs from runs".format(name))
+
+    def test_random_streams_chunk(self):
+        """Check that chunk streams are used and give the same result
+        with any split of the simulation into batches of steps and runs"""
+        start = '2019-01-01'
+        end = '2022-12-31'
+        parameters = dict(host='host', total_plants='max_host', infected='infection',
+                          start_date=start, end_date=end, seasonality=[1, 12], step_unit='week',
+                          step_num_units=1, output_frequency='yearly',
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          anthropogenic_dispersal_kernel='cauchy', anthropogenic_distance=1000,
+                          anthropogenic_direction_strength=0, percent_natural_dispersal=0.95,
+                          random_seed=1, runs=5)
+        self.assertModule('r.pops.spread', average='average_run', nprocs=1, **parameters)
+        self.assertModule('r.pops.spread', average='average_1', nprocs=1,
+                          random_streams='chunk', **parameters)
+        self.assertModule('r.pops.spread', average='average_3', nprocs=3,
+                          weather_window=7, run_batch_size=2,
+                          random_streams='chunk', **parameters)
+        self.assertRastersNoDifference(actual='average_3', reference='average_1', precision=0)
+        # streams are derived for each chunk, so runs differ from run streams
+        self.runModule('r.mapcalc', expression='average_difference = abs(average_1 - average_run)')
+        difference = gs.parse_command('r.univar', map='average_difference', flags='g')
+        self.assertGreater(float(difference['max']), 0)
+
+    def test_checkpoint_restart(self):
+        """Check that continuing from checkpoint gives the same result"""
+        start = '2019-01-01'
+        end = '2022-12-31'
+        checkpoint = gs.tempfile(create=False)
+        parameters = dict(host='host', total_plants='max_host', infected='infection',
+                          start_date=start, end_date=end, seasonality=[1, 12], step_unit='week',
+                          step_num_units=1, output_frequency='yearly',
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          anthropogenic_dispersal_kernel='cauchy', anthropogenic_distance=1000,
+                          anthropogenic_direction_strength=0, percent_natural_dispersal=0.95,
+                          random_seed=1, runs=5, nprocs=5, random_streams='chunk')
+        # the last checkpoint is from the output before the last one
+        self.assertModule('r.pops.spread', average='average_full', checkpoint=checkpoint,
+                          **parameters)
+        self.assertFileExists(checkpoint)
+        self.assertModule('r.pops.spread', average='average_restart', restart=checkpoint,
+                          **parameters)
+        self.assertRastersNoDifference(actual='average_restart', reference='average_full',
+                                       precision=0)
+
+    def test_checkpoint_restart_monthly(self):
+        """Check that continuing from checkpoint within a year gives the same outputs"""
+        checkpoint = gs.tempfile(create=False)
+        rate_full = gs.tempfile(create=False)
+        rate_restart = gs.tempfile(create=False)
+        parameters = dict(host='host', total_plants='max_host', infected='infection',
+                          start_date='2019-01-01', end_date='2020-12-31', seasonality=[1, 12],
+                          step_unit='week', step_num_units=1, output_frequency='monthly',
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          anthropogenic_dispersal_kernel='cauchy', anthropogenic_distance=1000,
+                          anthropogenic_direction_strength=0, percent_natural_dispersal=0.95,
+                          random_seed=1, runs=5, nprocs=5, random_streams='chunk')
+        # the last checkpoint is from November, after the last spread rate step
+        self.assertModule('r.pops.spread', average='average_full', single_series='single_full',
+                          average_series='average_full', stddev_series='stddev_full',
+                          probability_series='probability_full', spread_rate_output=rate_full,
+                          checkpoint=checkpoint, **parameters)
+        self.assertFileExists(checkpoint)
+        self.assertModule('r.pops.spread', average='average_restart',
+                          single_series='single_restart', average_series='average_restart',
+                          stddev_series='stddev_restart', probability_series='probability_restart',
+                          spread_rate_output=rate_restart, restart=checkpoint, **parameters)
+        self.assertRastersNoDifference(actual='average_restart', reference='average_full',
+                                       precision=0)
+        for name in ('single', 'average', 'stddev', 'probability'):
+            self.assertRastersNoDifference(actual=name + '_restart_2020_12_31',
+                                           reference=name + '_full_2020_12_31',
+                                           precision=0)
+        with open(rate_full) as full, open(rate_restart) as restart:
+            self.assertEqual(restart.read(), full.read())
+        for name in (checkpoint, rate_full, rate_restart):
+            gs.try_remove(name)
+
+    def test_fork_date(self):
+        """Check that runs are the same before fork date"""
+        start = '2019-01-01'
+        end = '2022-12-31'
+        self.assertModule('r.pops.spread', host='host', total_plants='max_host', infected='infection',
+                          average='average', stddev='stddev', stddev_series='stddev',
+                          start_date=start, end_date=end, seasonality=[1, 12], step_unit='week',
+                          step_num_units=1,
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          anthropogenic_dispersal_kernel='cauchy', anthropogenic_distance=1000,
+                          anthropogenic_direction_strength=0, percent_natural_dispersal=0.95,
+                          random_seed=1, runs=5, nprocs=5, fork_date='2021-01-01')
+        self.assertRasterMinMax('stddev_2019_12_31', refmin=0, refmax=0)
+        self.assertRasterMinMax('stddev_2020_12_31', refmin=0, refmax=0)
+        self.assertRasterExists('stddev_2022_12_31')
+
+    def test_fork_date_chunk_streams(self):
+        """Check fork within a chunk with chunk streams against restart from one run"""
+        checkpoint = gs.tempfile(create=False)
+        parameters = dict(host='host', total_plants='max_host', infected='infection',
+                          start_date='2019-01-01', end_date='2020-12-31', seasonality=[1, 12],
+                          step_unit='week', step_num_units=1, output_frequency='yearly',
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          anthropogenic_dispersal_kernel='cauchy', anthropogenic_distance=1000,
+                          anthropogenic_direction_strength=0, percent_natural_dispersal=0.95,
+                          random_seed=1, nprocs=4, random_streams='chunk')
+        # fork date is in the middle of the second chunk (year)
+        self.assertModule('r.pops.spread', average='average_fork', stddev='stddev_fork',
+                          stddev_series='stddev_fork', runs=4, fork_date='2020-07-01',
+                          **parameters)
+        self.assertRasterMinMax('stddev_fork_2019_12_31', refmin=0, refmax=0)
+        # the checkpoint after the first year has only the first run
+        self.assertModule('r.pops.spread', average='average_one', runs=1,
+                          checkpoint=checkpoint, **parameters)
+        self.assertModule('r.pops.spread', average='average_restart', stddev='stddev_restart',
+                          runs=4, fork_date='2020-07-01', restart=checkpoint, **parameters)
+        self.assertRastersNoDifference(actual='average_restart', reference='average_fork',
+                                       precision=0)
+        self.assertRastersNoDifference(actual='stddev_restart', reference='stddev_fork',
+                                       precision=0)
+        # runs use different streams after the fork
+        info = gs.raster_info('stddev_fork')
+        self.assertGreater(info['max'], 0)
+        gs.try_remove(checkpoint)
+
+    def test_fork_date_scenarios(self):
+        """Check that scenarios with different treatments before fork date fail"""
+        scenarios = gs.tempfile(create=False)
+        with open(scenarios, 'w') as file:
+            file.write("name=none\n")
+            file.write("name=treated treatments=treatment treatment_date=2020-12-01"
+                       " treatment_length=0\n")
+        self.assertModuleFail('r.pops.spread', host='host', total_plants='max_host',
+                              infected='infection', average='average',
+                              start_date='2019-01-01', end_date='2022-12-31',
+                              seasonality=[1, 12], step_unit='week', step_num_units=1,
+                              reproductive_rate=1, natural_dispersal_kernel='exponential',
+                              natural_distance=50, random_seed=1, runs=2,
+                              scenario_file=scenarios, fork_date='2021-01-01')
+        gs.try_remove(scenarios)
+
+    def test_scenario_file(self):
+        """Check that scenario without treatments is the same as plain run"""
+        start = '2019-01-01'
+        end = '2022-12-31'
+        scenarios = gs.tempfile(create=False)
+        with open(scenarios, 'w') as file:
+            file.write("# comparison of no treatment with one treatment\n")
+            file.write("name=none\n")
+            file.write("name=treated treatments=treatment treatment_date=2020-12-01"
+                       " treatment_length=0 treatment_application=ratio_to_all\n")
+        parameters = dict(host='host', total_plants='max_host', infected='infection',
+                          start_date=start, end_date=end, seasonality=[1, 12], step_unit='week',
+                          step_num_units=1,
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          anthropogenic_dispersal_kernel='cauchy', anthropogenic_distance=1000,
+                          anthropogenic_direction_strength=0, percent_natural_dispersal=0.95,
+                          random_seed=1, runs=5, nprocs=5)
+        self.assertModule('r.pops.spread', average='average', **parameters)
+        self.assertModule('r.pops.spread', average='average_scenario',
+                          scenario_file=scenarios, **parameters)
+        self.assertRastersNoDifference(actual='average_scenario_none',
+                                       reference='average', precision=0)
+        self.assertRasterExists('average_scenario_treated')
+        # invalid values are reported as errors
+        with open(scenarios, 'w') as file:
+            file.write("name=treated treatments=treatment treatment_date=2020-12-01"
+                       " treatment_length=0 treatment_application=ratio\n")
+        self.assertModuleFail('r.pops.spread', average='average_scenario',
+                              scenario_file=scenarios, **parameters)
+        with open(scenarios, 'w') as file:
+            file.write("name=treated treatments=treatment treatment_date=2020-12-01"
+                       " treatment_length=one\n")
+        self.assertModuleFail('r.pops.spread', average='average_scenario',
+                              scenario_file=scenarios, **parameters)
+        gs.try_remove(scenarios)
+
+    def test_profile(self):
+        """Check that profile contains phases and counters"""
+        profile = gs.tempfile(create=False)
+        self.assertModule('r.pops.spread', host='host', total_plants='max_host', infected='infection',
+                          average='average', start_date='2019-01-01', end_date='2019-12-31',
+                          seasonality=[1, 12], step_unit='week', step_num_units=1,
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          random_seed=1, runs=2, nprocs=2, profile=profile)
+        with open(profile) as file:
+            result = json.load(file)
+        gs.try_remove(profile)
+        self.assertIn('simulation', result['phases'])
+        self.assertIn('input reading', result['phases'])
+        self.assertGreater(result['counters']['dispersers generated'], 0)
+        self.assertGreaterEqual(len(result['chunks']), 1)
+
+    def test_memory_estimate(self):
+        """Check that estimate is printed without simulation and limit fails"""
+        parameters = dict(host='host', total_plants='max_host', infected='infection',
+                          average='average', start_date='2019-01-01', end_date='2019-12-31',
+                          seasonality=[1, 12], step_unit='week', step_num_units=1,
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          random_seed=1, runs=1000)
+        output = call_module('r.pops.spread', flags='e', **parameters)
+        total = [line for line in output.splitlines() if line.startswith('total:')]
+        self.assertEqual(len(total), 1)
+        self.assertGreater(float(total[0].split()[1]), 0)
+        self.assertRasterDoesNotExist('average')
+        self.assertModuleFail('r.pops.spread', memory_limit=1, **parameters)
+
+    def test_run_batches(self):
+        """Check that runs simulated in batches give the same statistics"""
+        parameters = dict(host='host', total_plants='max_host', infected='infection',
+                          start_date='2019-01-01', end_date='2020-12-31',
+                          seasonality=[1, 12], step_unit='week', step_num_units=1,
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          random_seed=1, runs=6, nprocs=2)
+        self.assertModule('r.pops.spread', average='average', stddev='stddev',
+                          probability='probability', average_series='average',
+                          **parameters)
+        self.assertModule('r.pops.spread', average='average_batches', stddev='stddev_batches',
+                          probability='probability_batches', average_series='average_batches',
+                          run_batch_size=4, **parameters)
+        self.assertRastersNoDifference(actual='average_batches', reference='average',
+                                       precision=1e-9)
+        self.assertRastersNoDifference(actual='average_batches_2019_12_31',
+                                       reference='average_2019_12_31', precision=1e-9)
+        self.assertRastersNoDifference(actual='stddev_batches', reference='stddev',
+                                       precision=1e-9)
+        self.assertRastersNoDifference(actual='probability_batches', reference='probability',
+                                       precision=0)
+
+    def test_run_batches_weather(self):
+        """Check that batches of runs use weather of the right steps"""
+        weather = gs.tempfile(create=False)
+        names = ['weather_1', 'weather_2', 'weather_3']
+        for name, value in zip(names, [1, 0.8, 0.6]):
+            self.runModule('r.mapcalc', expression='{} = {}'.format(name, value))
+        with open(weather, 'w') as file:
+            for step in range(105):
+                file.write(names[step % len(names)] + '\n')
+        parameters = dict(host='host', total_plants='max_host', infected='infection',
+                          start_date='2019-01-01', end_date='2020-12-31',
+                          seasonality=[1, 12], step_unit='week', step_num_units=1,
+                          reproductive_rate=1, natural_dispersal_kernel='exponential', natural_distance=50,
+                          natural_direction='W', natural_direction_strength=3,
+                          weather_coefficient_file=weather,
+                          random_seed=1, runs=6, nprocs=2)
+        self.assertModule('r.pops.spread', average='average', **parameters)
+        self.assertModule('r.pops.spread', average='average_batches',
+                          run_batch_size=4, **parameters)
+        self.assertModule('r.pops.spread', average='average_reading',
+                          run_batch_size=4, weather_window=10, **parameters)
+        self.assertRastersNoDifference(actual='average_batches', reference='average',
+                                       precision=1e-9)
+        self.assertRastersNoDifference(actual='average_reading', reference='average',
+                                       precision=1e-9)
+        self.runModule('g.remove', flags='f', type='raster', name=names)
+        gs.try_remove(weather)
+
+    def test_saturation(self):
+        """Check that runs stopped without susceptible hosts give the same outputs
+
+        All hosts get infected in the first year. In the SI model, runs
+        without susceptible hosts stop, which is compared with runs which
+        continue because spread rate is computed. With mortality or in
+        the SEI model, runs don't stop and all outputs are written.
+        """
+        self.runModule('r.mapcalc', expression='host_saturated = 10')
+        self.runModule('r.mapcalc', expression='infection_saturated = 5')
+        spread_rate = gs.tempfile(create=False)
+        parameters = dict(host='host_saturated', total_plants='host_saturated',
+                          infected='infection_saturated',
+                          start_date='2019-01-01', end_date='2021-12-31',
+                          seasonality=[1, 12], step_unit='week', step_num_units=1,
+                          reproductive_rate=5, natural_dispersal_kernel='exponential', natural_distance=50,
+                          random_seed=1, runs=2, nprocs=2)
+        self.assertModule('r.pops.spread', average='average', average_series='average',
+                          single_series='single', **parameters)
+        self.assertModule('r.pops.spread', average='average_all', average_series='average_all',
+                          single_series='single_all', spread_rate_output=spread_rate,
+                          **parameters)
+        self.assertRasterMinMax('average', refmin=10, refmax=10)
+        for suffix in ['', '_2019_12_31', '_2020_12_31', '_2021_12_31']:
+            self.assertRastersNoDifference(actual='average' + suffix,
+                                           reference='average_all' + suffix, precision=0)
+        self.assertRastersNoDifference(actual='single_2021_12_31',
+                                       reference='single_all_2021_12_31', precision=0)
+        # exposed hosts become infected after the saturation
+        self.assertModule('r.pops.spread', average='average_sei', model_type='SEI',
+                          latency_period=4, **parameters)
+        self.assertRasterMinMax('average_sei', refmin=10, refmax=10)
+        # infected hosts keep dying after the saturation
+        self.assertModule('r.pops.spread', average='average_dead', flags='m',
+                          mortality_rate=0.5, mortality_time_lag=1,
+                          mortality_series='dead', **parameters)
+        for year in [2019, 2020, 2021]:
+            self.assertRasterExists('dead_{}_12_31'.format(year))
+        dead = gs.parse_command('r.univar', map='dead_2021_12_31', flags='g')
+        dead_before = gs.parse_command('r.univar', map='dead_2020_12_31', flags='g')
+        self.assertGreater(float(dead['mean']), float(dead_before['mean']))
+        self.runModule('g.remove', flags='f', type='raster',
+                       name=['host_saturated', 'infection_saturated'])
+        gs.try_remove(spread_rate)
+
     def test_outputs_mortality(self):
         start = '2019-01-01'
         end = '2022-12-31'
@@ -0,0 +1,233 @@
+/*
+ * PoPS model - Reading weather coefficients from GRASS GIS raster maps
+ *
+ * Copyright (C) 2021 by the authors.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef WEATHER_HPP
+#define WEATHER_HPP
+
+#include "graster.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/** Reads weather coefficient for a given simulation step
+ *
+ * The coefficient is either read directly from a weather coefficient
+ * raster map or computed as a product of moisture and temperature
+ * coefficients. Raster map names are indexed by simulation step.
+ *
+ * The reader keeps a scratch raster for the product, so one reader
+ * should be used only from one thread at a time. The reader holds
+ * grass_mutex() while reading, so it can run concurrently with other
+ * threads which do the same.
+ */
+class WeatherReader
+{
+public:
+    WeatherReader(const std::vector<std::string>& weather_names,
+                  const std::vector<std::string>& moisture_names,
+                  const std::vector<std::string>& temperature_names)
+        : weather_names_(weather_names),
+          moisture_names_(moisture_names),
+          temperature_names_(temperature_names)
+    {}
+
+    /** True if there is any weather to read */
+    bool enabled() const
+    {
+        return !weather_names_.empty() || !moisture_names_.empty();
+    }
+
+    /** Read weather coefficient for one simulation step
+     *
+     * The coefficient raster needs to be already allocated for the
+     * current computational region.
+     */
+    void read(unsigned step, DImg& coefficient)
+    {
+        std::lock_guard<std::mutex> lock(grass_mutex());
+        if (!moisture_names_.empty()) {
+            raster_from_grass(moisture_names_[step].c_str(), coefficient);
+            if (temperature_.rows() != coefficient.rows()
+                    || temperature_.cols() != coefficient.cols())
+                temperature_ = DImg(coefficient.rows(), coefficient.cols());
+            raster_from_grass(temperature_names_[step].c_str(), temperature_);
+            Float* data = coefficient.data();
+            const Float* temperature = temperature_.data();
+            size_t size = size_t(coefficient.rows()) * coefficient.cols();
+            for (size_t i = 0; i < size; ++i)
+                data[i] *= temperature[i];
+        }
+        else {
+            raster_from_grass(weather_names_[step].c_str(), coefficient);
+        }
+    }
+
+private:
+    std::vector<std::string> weather_names_;
+    std::vector<std::string> moisture_names_;
+    std::vector<std::string> temperature_names_;
+    DImg temperature_;
+};
+
+/** Fixed-size ring buffer of weather coefficient rasters
+ *
+ * All rasters are allocated once when the buffer is created and then
+ * reused, so the memory used for weather does not depend on the number
+ * of simulation steps. Slots are addressed by an ever-increasing index
+ * which wraps around the capacity.
+ *
+ * Without weather, the buffer contains one empty raster, so that
+ * there is something to pass to the model.
+ */
+class WeatherBuffer
+{
+public:
+    WeatherBuffer(unsigned capacity, unsigned rows, unsigned cols)
+    {
+        if (capacity) {
+            slots_.reserve(capacity);
+            for (unsigned i = 0; i < capacity; ++i)
+                slots_.emplace_back(rows, cols);
+        }
+        else {
+            slots_.resize(1);
+        }
+    }
+
+    DImg& operator[](unsigned index)
+    {
+        return slots_[index % slots_.size()];
+    }
+
+    /** Number of rasters in the buffer */
+    unsigned capacity() const
+    {
+        return slots_.size();
+    }
+
+    /** Memory used by raster data in the buffer in bytes */
+    size_t memory() const
+    {
+        size_t bytes = 0;
+        for (const auto& slot : slots_)
+            bytes += sizeof(Float) * slot.rows() * slot.cols();
+        return bytes;
+    }
+
+private:
+    std::vector<DImg> slots_;
+};
+
+/** Reads weather coefficients for the next batch of steps in background
+ *
+ * The coefficients are read into the next free slots of a WeatherBuffer.
+ * Only one batch is read ahead, so with a buffer capacity of at least
+ * twice the largest batch, the batch being read never overwrites
+ * the batch being simulated.
+ *
+ * GRASS GIS library is not thread-safe, so other threads need to hold
+ * grass_mutex() or use wait() when calling GRASS GIS functions while
+ * reading is in progress.
+ */
+class WeatherPrefetcher
+{
+public:
+    WeatherPrefetcher(WeatherReader& reader, WeatherBuffer& buffer)
+        : reader_(reader), buffer_(buffer)
+    {}
+
+    ~WeatherPrefetcher()
+    {
+        wait();
+    }
+
+    /** Start reading weather coefficients for the given steps
+     *
+     * When there is no weather, nothing is read.
+     */
+    void request(const std::vector<unsigned>& steps)
+    {
+        wait();
+        requested_ = next_slot_;
+        if (!reader_.enabled())
+            return;
+        next_slot_ += steps.size();
+        if (replay_)
+            return;
+        WeatherReader& reader = reader_;
+        WeatherBuffer& buffer = buffer_;
+        unsigned first = requested_;
+        pending_ = std::async(
+                    std::launch::async,
+                    [&reader, &buffer, steps, first]() {
+                        auto start = std::chrono::steady_clock::now();
+                        unsigned slot = first;
+                        for (auto step : steps)
+                            reader.read(step, buffer[slot++]);
+                        std::chrono::duration<double> duration =
+                                std::chrono::steady_clock::now() - start;
+                        return duration.count();
+                    });
+    }
+
+    /** Request the same steps again without reading them
+     *
+     * Following requests get the slots from the first one in the same
+     * order as before, so the buffer needs to hold all the requested
+     * steps without wrapping around.
+     */
+    void replay()
+    {
+        wait();
+        next_slot_ = 0;
+        replay_ = true;
+    }
+
+    /** Wait for the requested coefficients
+     *
+     * Returns index of the buffer slot with the first step.
+     */
+    unsigned take()
+    {
+        wait();
+        return requested_;
+    }
+
+    /** Wait until the reading (if any) is finished */
+    void wait()
+    {
+        if (pending_.valid())
+            read_time_ += pending_.get();
+    }
+
+    /** Total wall time of finished reading in seconds */
+    double read_time() const
+    {
+        return read_time_;
+    }
+
+private:
+    WeatherReader& reader_;
+    WeatherBuffer& buffer_;
+    std::future<double> pending_;
+    double read_time_{0};
+    unsigned next_slot_{0};
+    unsigned requested_{0};
+    bool replay_{false};
+};
+
+#endif // WEATHER_HPP